@@ -1,12 +1,334 @@
 #include "rayt.h"
+#include <cstring>
+#ifdef __linux__
+#include <sys/wait.h>
+#endif
 
-int main()
+// start `count` worker processes of this executable with the same scene options
+static std::vector<pid_t> spawn_workers(int count, int argc, char **argv, const std::string &socket)
+{
+    std::vector<pid_t> pids;
+#ifdef __linux__
+    std::vector<std::string> args = {argv[0]};
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--coordinator") == 0 || strcmp(argv[i], "--socket") == 0 || strcmp(argv[i], "--output") == 0)
+        {
+            ++i;
+            continue;
+        }
+        args.push_back(argv[i]);
+    }
+    for (const char *a : {"--worker", socket.c_str(), "--progress", "0"})
+    {
+        args.push_back(a);
+    }
+    std::vector<char *> cargs;
+    for (auto &a : args)
+    {
+        cargs.push_back(const_cast<char *>(a.c_str()));
+    }
+    cargs.push_back(nullptr);
+    for (int k = 0; k < count; ++k)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execv("/proc/self/exe", cargs.data());
+            _exit(127);
+        }
+        if (pid > 0)
+        {
+            pids.push_back(pid);
+        }
+    }
+#endif
+    return pids;
+}
+
+static void wait_workers(const std::vector<pid_t> &pids)
+{
+#ifdef __linux__
+    for (pid_t pid : pids)
+    {
+        waitpid(pid, nullptr, 0);
+    }
+#endif
+}
+
+int main(int argc, char **argv)
 {
     int nx = 200;
     int ny = 100;
     int ns = 100;
+    float timeBudget = 0.f; // seconds, 0: render a fixed number of samples
+    int passSamples = 4;
+    float previewInterval = 0.f;
+    rayt::SceneType sceneType = rayt::kRectLightScene;
+    rayt::LightSampling lightSampling = rayt::kNoLightSampling;
+    const char *environment = nullptr;
+    bool pathGuiding = false;
+    int threads = 0;
+    int tileSize = TILE_SIZE;
+    float progressInterval = 1.f;
+    bool progressJson = false;
+    rayt::TileOrder tileOrder = rayt::kScanlineOrder;
+    bool perfCounters = false;
+    bool numa = false;
+    bool sampleParallel = false;
+    bool packets = false;
+    bool wavefront = false;
+    bool sortRays = false;
+    bool bvh = false;
+    bool frustum = false;
+    bool materialTable = false;
+    bool specialize = true; // integrator specialized to the scene's features
+    int features = -1;       // >= 0: SceneFeature bits forced into the specialized integrator
+    bool renderQueue = false; // render() as a job of a shared RenderQueue
+    int frames = 0;       // > 0: render an animation
+    int pipelineDepth = 2; // frames buffered between build, render and write
+    const char *output = nullptr;
+    int coordinator = -1; // >= 0: distribute tiles to worker processes, this many started here
+    const char *socket = nullptr;
+    const char *worker = nullptr;
+    int benchShapes = 0; // > 0: time ShapeList::hit against hitEach with this many shapes
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--spp") == 0 && i + 1 < argc)
+        {
+            ns = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+        {
+            timeBudget = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--pass") == 0 && i + 1 < argc)
+        {
+            passSamples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--preview") == 0 && i + 1 < argc)
+        {
+            previewInterval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+        {
+            ++i;
+            sceneType = strcmp(argv[i], "manylights") == 0 ? rayt::kManyLightsScene
+                        : strcmp(argv[i], "window") == 0   ? rayt::kWindowScene
+                                                           : rayt::kRectLightScene;
+        }
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+        {
+            ++i;
+            lightSampling = strcmp(argv[i], "uniform") == 0 ? rayt::kUniformLightSampling
+                            : strcmp(argv[i], "power") == 0 ? rayt::kPowerLightSampling
+                            : strcmp(argv[i], "bvh") == 0   ? rayt::kLightBVHSampling
+                                                            : rayt::kNoLightSampling;
+        }
+        else if (strcmp(argv[i], "--env") == 0 && i + 1 < argc)
+        {
+            environment = argv[++i];
+        }
+        else if (strcmp(argv[i], "--guide") == 0)
+        {
+            pathGuiding = true;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--tile") == 0 && i + 1 < argc)
+        {
+            tileSize = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--progress") == 0 && i + 1 < argc)
+        {
+            progressInterval = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--progress-json") == 0)
+        {
+            progressJson = true;
+        }
+        else if (strcmp(argv[i], "--order") == 0 && i + 1 < argc)
+        {
+            ++i;
+            tileOrder = strcmp(argv[i], "morton") == 0    ? rayt::kMortonOrder
+                        : strcmp(argv[i], "hilbert") == 0 ? rayt::kHilbertOrder
+                        : strcmp(argv[i], "spiral") == 0  ? rayt::kSpiralOrder
+                                                          : rayt::kScanlineOrder;
+        }
+        else if (strcmp(argv[i], "--perf") == 0)
+        {
+            perfCounters = true;
+        }
+        else if (strcmp(argv[i], "--numa") == 0)
+        {
+            numa = true;
+        }
+        else if (strcmp(argv[i], "--sample-parallel") == 0)
+        {
+            sampleParallel = true;
+        }
+        else if (strcmp(argv[i], "--packets") == 0)
+        {
+            packets = true;
+        }
+        else if (strcmp(argv[i], "--wavefront") == 0)
+        {
+            wavefront = true;
+        }
+        else if (strcmp(argv[i], "--sort-rays") == 0)
+        {
+            sortRays = true;
+        }
+        else if (strcmp(argv[i], "--bvh") == 0)
+        {
+            bvh = true;
+        }
+        else if (strcmp(argv[i], "--frustum") == 0)
+        {
+            bvh = true;
+            frustum = true;
+        }
+        else if (strcmp(argv[i], "--material-table") == 0)
+        {
+            materialTable = true;
+        }
+        else if (strcmp(argv[i], "--general-integrator") == 0)
+        {
+            specialize = false;
+        }
+        else if (strcmp(argv[i], "--features") == 0 && i + 1 < argc)
+        {
+            features = int(strtol(argv[++i], nullptr, 0));
+        }
+        else if (strcmp(argv[i], "--queue") == 0)
+        {
+            renderQueue = true;
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+        {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--coordinator") == 0 && i + 1 < argc)
+        {
+            coordinator = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+        {
+            socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+        {
+            worker = argv[++i];
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+        {
+            frames = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+        {
+            pipelineDepth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--bench-shapes") == 0 && i + 1 < argc)
+        {
+            benchShapes = atoi(argv[++i]);
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [--spp n] [--time seconds] [--pass spp] [--preview seconds]"
+                      << " [--scene rect|manylights|window] [--lights none|uniform|power|bvh] [--env file.hdr] [--guide]"
+                      << " [--threads n] [--tile size] [--progress seconds] [--progress-json]"
+                      << " [--order scanline|morton|hilbert|spiral] [--perf] [--numa] [--sample-parallel] [--packets] [--wavefront [--sort-rays]] [--bvh] [--frustum] [--general-integrator [--material-table]] [--features mask] [--queue]"
+                      << " [--frames n] [--pipeline depth] [--output file.bmp|png|jpg]"
+                      << " [--coordinator workers [--socket path]] [--worker socket] [--bench-shapes n]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (benchShapes > 0)
+    {
+        return rayt::bench_shape_list(benchShapes) ? 0 : 1;
+    }
+
+    if (features < -1 || features > rayt::kAllFeatures)
+    {
+        std::cerr << "--features takes a SceneFeature mask from 0 to 0x1f" << std::endl;
+        return 1;
+    }
+
+    if (pathGuiding && timeBudget <= 0.f)
+    {
+        std::cerr << "--guide needs a time budget (--time)" << std::endl;
+        return 1;
+    }
+
     std::unique_ptr<rayt::Scene> scene(new rayt::Scene(nx, ny, ns));
-    scene->render();
+    scene->setSceneType(sceneType);
+    scene->setLightSampling(lightSampling);
+    scene->setPathGuiding(pathGuiding);
+    scene->setNuma(numa);
+    scene->setThreads(threads);
+    scene->setTileSize(tileSize);
+    scene->setProgress(progressInterval, progressJson);
+    scene->setTileOrder(tileOrder);
+    scene->setSampleParallel(sampleParallel);
+    scene->setPackets(packets);
+    scene->setWavefront(wavefront);
+    scene->setRaySorting(sortRays);
+    scene->setBVH(bvh);
+    scene->setFrustumCulling(frustum);
+    scene->setMaterialTable(materialTable);
+    scene->setSpecialize(specialize);
+    scene->setFeatures(features);
+    scene->setPerfCounters(perfCounters);
+    std::unique_ptr<rayt::RenderQueue> queue;
+    if (renderQueue)
+    {
+        rayt::NumaTopology topology = rayt::NumaTopology::detect();
+        queue.reset(new rayt::RenderQueue(threads, numa ? &topology : nullptr));
+        scene->setRenderQueue(queue.get());
+    }
+    if (output)
+    {
+        scene->setOutput(output);
+    }
+    if (environment && !scene->loadEnvironment(environment))
+    {
+        std::cerr << "cannot load environment map " << environment << std::endl;
+        return 1;
+    }
+    auto written = [](const std::string &filename, bool ok)
+    {
+        if (!ok)
+        {
+            std::cerr << "cannot write " << filename << std::endl;
+        }
+    };
+    std::future<bool> result;
+    if (worker)
+    {
+        return scene->renderWorker(worker) ? 0 : 1;
+    }
+    else if (coordinator >= 0)
+    {
+        std::string path = socket ? socket : "/tmp/rayt-" + std::to_string(getpid()) + ".sock";
+        std::vector<pid_t> pids = spawn_workers(coordinator, argc, argv, path);
+        result = scene->renderCoordinator(path, written);
+        wait_workers(pids);
+    }
+    else if (frames > 0)
+    {
+        scene->renderAnimation(frames, pipelineDepth);
+    }
+    else if (timeBudget > 0.f)
+    {
+        result = scene->renderProgressive(timeBudget, passSamples, previewInterval, written);
+    }
+    else
+    {
+        result = scene->render(written);
+    }
 
-    return 0;
-}
\ No newline at end of file
+    return result.valid() && !result.get() ? 1 : 0;
+}
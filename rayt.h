@@ -3,16 +3,68 @@
 #include <random>
 #include <float.h> // FLT_MIN, FLT_MAX
 #include <vector>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <numeric>
+#include <climits>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <future>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <cerrno>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+// vectormath backend, chosen at build time (see Makefile): scalar, or SSE with -DRAYT_VECTORMATH_SSE
+#ifdef RAYT_VECTORMATH_SSE
+#include "vectormath/SSE/cpp/vectormath_aos.h"
+#else
 #include "vectormath/scalar/cpp/vectormath_aos.h"
+#endif
+// the SoA types are x86 only: without SSE2, packets and the shape arrays fall back to scalar code
+#if defined(__SSE2__)
+#include "vectormath/x86/vectormath_soa4.h"
+#ifdef __AVX2__
+#include "vectormath/x86/vectormath_soa8.h"
+#endif
+#endif
 using namespace Vectormath::Aos;
 typedef Vector3 vec3;
 typedef Vector3 col3;
+#if defined(__SSE2__)
+using namespace Vectormath::Soa;
+typedef Vector3x4 vec3x4;
+#ifdef __AVX2__
+typedef Vector3x8 vec3x8;
+#endif
+#endif
 
 #define PI 3.14159265359f
 #define PI2 6.28318530718f
@@ -22,8 +74,20 @@ typedef Vector3 col3;
 #define EPSILON 1e-6f
 #define GAMMA_FACTOR 2.2f
 
-#define NUM_THREAD 8
+#define TILE_SIZE 16
+#define SAMPLE_SPLIT_TASKS 1024 // tasks a sample-parallel render aims for, whatever the thread count
 #define MAX_DEPTH 50
+#define WAVEFRONT_PATHS 4096 // paths traced together by the wavefront integrator
+#define BVH_LEAF_SHAPES 4
+#define BVH_STACK 64
+
+#define GUIDE_FRACTION 0.5f          // probability of sampling the guiding distribution
+#define GUIDE_SPLIT_SAMPLES 4000.f   // spatial leaves with more samples per iteration are split (scaled by sqrt(spp))
+#define GUIDE_ENERGY_THRESHOLD 0.01f // directional nodes with more energy are subdivided
+#define GUIDE_MAX_DEPTH 20
+
+#define DIST_MAGIC 0x54594152  // "RAYT", first word of a worker's hello
+#define DIST_IDLE_TIMEOUT 30.f // seconds a coordinator waits while no worker is connected
 
 inline float pow2(float x)
 {
@@ -49,9 +113,94 @@ inline float smoothstep(float a, float b, float t)
 inline float radians(float deg) { return (deg / 180.f) * PI; }
 inline float degrees(float rad) { return (rad / PI) * 180.f; }
 
+// per-thread random numbers; drand48 shares a single state between all threads
+inline uint64_t &random_state()
+{
+    thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id());
+    return state;
+}
+
+inline void seed_random(uint64_t seed)
+{
+    random_state() = seed;
+}
+
+// seed of an independent random sequence for item (a, b), e.g. a tile and a sample slot
+inline uint64_t hash_seed(uint64_t a, uint64_t b)
+{
+    uint64_t z = (a + 1) * 0x9e3779b97f4a7c15ull ^ (b + 1) * 0xc2b2ae3d27d4eb4full;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// uniform in [0, 1), splitmix64
+inline float random_float()
+{
+    uint64_t z = (random_state() += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return float(z >> 40) * (1.f / 16777216.f);
+}
+
+// rays traced by this thread
+inline uint64_t &ray_count()
+{
+    thread_local uint64_t count = 0;
+    return count;
+}
+
+// nanoseconds this thread spent sorting rays
+inline uint64_t &ray_sort_time()
+{
+    thread_local uint64_t time = 0;
+    return time;
+}
+
+// index of the lowest set bit, bits != 0
+inline int lowest_bit(unsigned bits)
+{
+#if defined(__GNUC__)
+    return __builtin_ctz(bits);
+#else
+    int k = 0;
+    for (; !(bits & 1); bits >>= 1)
+    {
+        ++k;
+    }
+    return k;
+#endif
+}
+
+#if defined(__SSE2__)
+// v in all four lanes
+inline vec3x4 broadcast(const vec3 &v)
+{
+    return vec3x4(floatx4(v.getX()), floatx4(v.getY()), floatx4(v.getZ()));
+}
+
+inline vec3 lane(const vec3x4 &v, int k)
+{
+    return vec3(v.getX().get(k), v.getY().get(k), v.getZ().get(k));
+}
+
+#ifdef __AVX2__
+inline vec3x8 broadcast8(const vec3 &v)
+{
+    return vec3x8(floatx8(v.getX()), floatx8(v.getY()), floatx8(v.getZ()));
+}
+
+inline vec3 lane(const vec3x8 &v, int k)
+{
+    return vec3(v.getX().get(k), v.getY().get(k), v.getZ().get(k));
+}
+#endif
+#endif
+
 inline vec3 random_vector()
 {
-    return vec3(drand48(), drand48(), drand48());
+    return vec3(random_float(), random_float(), random_float());
 }
 
 inline vec3 random_in_unit_sphere()
@@ -65,6 +214,34 @@ inline vec3 random_in_unit_sphere()
     return p;
 }
 
+inline vec3 random_unit_vector()
+{
+    vec3 p;
+    do
+    {
+        p = random_in_unit_sphere();
+    } while (lengthSqr(p) < EPSILON);
+    return normalize(p);
+}
+
+// cosine weighted direction around the unit normal n
+inline vec3 random_cosine_direction(const vec3 &n)
+{
+    vec3 d = n + random_unit_vector();
+    float l = lengthSqr(d);
+    return l > EPSILON ? d / sqrtf(l) : n;
+}
+
+inline void atomic_add(float &dst, float v)
+{
+    float cur, next;
+    __atomic_load(&dst, &cur, __ATOMIC_RELAXED);
+    do
+    {
+        next = cur + v;
+    } while (!__atomic_compare_exchange(&dst, &cur, &next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 inline vec3 linear_to_gamma(const vec3 &v, float gammaFactor)
 {
     float recipGammaFactor = recip(gammaFactor);
@@ -109,6 +286,11 @@ inline float schlick(float cosine, float ri)
     return r0 + (1.f - r0) * pow5(1.f - cosine);
 }
 
+inline float luminance(const vec3 &c)
+{
+    return 0.2126f * c.getX() + 0.7152f * c.getY() + 0.0722f * c.getZ();
+}
+
 inline void get_sphere_uv(const vec3 &p, float &u, float &v)
 {
     float phi = atan2(p.getZ(), p.getX());
@@ -131,9 +313,19 @@ namespace rayt
     class Shape;
     typedef std::shared_ptr<Shape> ShapePtr;
 
+    // concrete texture classes, for compiling texture trees
+    enum TextureType
+    {
+        kColorTexture = 0,
+        kCheckerTexture,
+        kImageTexture,
+        kOtherTexture,
+    };
+
     class Texture
     {
     public:
+        virtual TextureType type() const { return kOtherTexture; }
         virtual vec3 value(float u, float v, const vec3 &p) const = 0;
     };
 
@@ -141,12 +333,15 @@ namespace rayt
     {
     public:
         ColorTexture(const vec3 &c) : m_color(c) {}
+        virtual TextureType type() const override { return kColorTexture; }
 
         vec3 value(float u, float v, const vec3 &p) const override
         {
             return m_color;
         }
 
+        const vec3 &color() const { return m_color; }
+
     private:
         vec3 m_color;
     };
@@ -156,10 +351,10 @@ namespace rayt
     public:
         CheckerTexture(const TexturePtr &t0, const TexturePtr &t1, float freq)
             : m_odd(t0), m_even(t1), m_freq(freq) {}
+        virtual TextureType type() const override { return kCheckerTexture; }
         virtual vec3 value(float u, float v, const vec3 &p) const override
         {
-            float sines = sinf(m_freq * p.getX()) * sinf(m_freq * p.getY()) * sinf(m_freq * p.getZ());
-            if (sines < 0)
+            if (sines(m_freq, p) < 0)
             {
                 return m_odd->value(u, v, p);
             }
@@ -169,6 +364,16 @@ namespace rayt
             }
         }
 
+        // negative on the odd squares
+        static float sines(float freq, const vec3 &p)
+        {
+            return sinf(freq * p.getX()) * sinf(freq * p.getY()) * sinf(freq * p.getZ());
+        }
+
+        const Texture *odd() const { return m_odd.get(); }
+        const Texture *even() const { return m_even.get(); }
+        float frequency() const { return m_freq; }
+
     private:
         TexturePtr m_odd;
         TexturePtr m_even;
@@ -188,6 +393,7 @@ namespace rayt
         {
             stbi_image_free(m_texels);
         }
+        virtual TextureType type() const override { return kImageTexture; }
 
         virtual vec3 value(float u, float v, const vec3 &p) const override
         {
@@ -287,475 +493,5219 @@ namespace rayt
         std::vector<std::unique_ptr<ImageFilter>> m_filters;
     };
 
-    class Ray
+    // Float accumulation buffer stored tile by tile, every tile in its own page aligned block.
+    // A block is zeroed by the first thread that adds samples to its tile, so with first-touch
+    // placement the tile lives on the NUMA node of the thread rendering it.
+    class AccumBuffer
     {
     public:
-        Ray() {}
-        Ray(const vec3 &o, const vec3 &dir)
-            : m_origin(o), m_direction(dir)
+        // shared: a tile may be added to by several threads at once, or resolved while it is
+        // added to (progressive passes); tiles then take a lock per span. Otherwise each tile
+        // has one writer, which is done before the buffer is resolved, and adds take no lock.
+        AccumBuffer(int w, int h, int tileSize = TILE_SIZE, bool shared = false)
+            : m_width(w), m_height(h), m_tileSize(tileSize), m_shared(shared),
+              m_tilesX((w + tileSize - 1) / tileSize), m_tiles(m_tilesX * ((h + tileSize - 1) / tileSize))
         {
+            size_t bytes = size_t(tileSize) * tileSize * (3 * sizeof(float) + sizeof(int));
+            m_stride = (bytes + 4095) / 4096 * 4096;
+            m_data = static_cast<char *>(std::aligned_alloc(4096, m_stride * m_tiles.size()));
         }
 
-        const vec3 &origin() const { return m_origin; }
-        const vec3 &direction() const { return m_direction; }
-        vec3 at(float t) const { return m_origin + t * m_direction; }
+        ~AccumBuffer()
+        {
+            std::free(m_data);
+        }
 
-    private:
-        vec3 m_origin;    // 始点
-        vec3 m_direction; // 方向（非正規化）
-    };
+        AccumBuffer(const AccumBuffer &) = delete;
+        AccumBuffer &operator=(const AccumBuffer &) = delete;
 
-    class Camera
-    {
-    public:
-        Camera() {}
-        Camera(const vec3 &u, const vec3 &v, const vec3 &w)
+        int width() const { return m_width; }
+        int height() const { return m_height; }
+
+        // add summed radiance of counts[k] samples to pixels [x0, x0 + n) of row y,
+        // the span has to stay within one tile
+        void addSpan(int x0, int y, int n, const float *rgb, const int *counts)
         {
-            m_origin = vec3(0);
-            m_uvw[0] = u;
-            m_uvw[1] = v;
-            m_uvw[2] = w;
+            int t = (y / m_tileSize) * m_tilesX + x0 / m_tileSize;
+            std::unique_lock<std::mutex> lock(m_tiles[t].mtx, std::defer_lock);
+            if (m_shared)
+            {
+                lock.lock();
+            }
+            if (!m_tiles[t].touched)
+            {
+                memset(m_data + m_stride * t, 0, m_stride);
+                m_tiles[t].touched = true;
+            }
+            int index = (y % m_tileSize) * m_tileSize + x0 % m_tileSize;
+            float *sum = tileRGB(t) + 3 * index;
+            int *count = tileCounts(t) + index;
+            for (int k = 0; k < n; ++k)
+            {
+                sum[3 * k + 0] += rgb[3 * k + 0];
+                sum[3 * k + 1] += rgb[3 * k + 1];
+                sum[3 * k + 2] += rgb[3 * k + 2];
+                count[k] += counts[k];
+            }
         }
-        Camera(
-            const vec3 &lookfrom,
-            const vec3 &lookat,
-            const vec3 &vup,
-            float vfov,
-            float aspect)
+
+        // write the per-pixel mean into img (row 0 of the buffer is the bottom of the image)
+        void resolve(Image &img) const
         {
-            vec3 u, v, w;
-            float halfH = tanf(radians(vfov) / 2.0f);
-            float halfW = aspect * halfH;
-            m_origin = lookfrom;
-            w = normalize(lookfrom - lookat);
-            u = normalize(cross(vup, w));
-            v = cross(w, u);
-            m_uvw[2] = m_origin - halfW * u - halfH * v - w;
-            m_uvw[0] = 2.0f * halfW * u;
-            m_uvw[1] = 2.0f * halfH * v;
+            forEachPixel([&](int x, int y, const float *sum, int count)
+                         {
+                float s = count > 0 ? recip(float(count)) : 0.f;
+                img.write(x, (m_height - y - 1), sum[0] * s, sum[1] * s, sum[2] * s); });
         }
 
-        Ray getRay(float u, float v) const
+        // per-pixel mean as top-down rgb floats
+        void resolve(std::vector<float> &rgb) const
         {
-            return Ray(m_origin, m_uvw[2] + m_uvw[0] * u + m_uvw[1] * v - m_origin);
+            rgb.resize(3 * m_width * m_height);
+            forEachPixel([&](int x, int y, const float *sum, int count)
+                         {
+                int out = m_width * (m_height - y - 1) + x;
+                float s = count > 0 ? recip(float(count)) : 0.f;
+                for (int c = 0; c < 3; ++c)
+                {
+                    rgb[3 * out + c] = sum[c] * s;
+                } });
         }
 
-    private:
-        vec3 m_origin; // position of the camera
-        vec3 m_uvw[3]; // orthonormal basis vector
-    };
-
-    class HitRec
-    {
-    public:
-        float t;
-        float u;
-        float v;
-        vec3 p;
-        vec3 n;
-        MaterialPtr mat;
-    };
-
-    class ScatterRec
-    {
-    public:
-        Ray ray;
-        vec3 albedo;
-    };
-
-    class Material
-    {
-    public:
-        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const = 0;
-        virtual vec3 emitted(const Ray &r, const HitRec &hrec) const { return vec3(0); }
-    };
-
-    class Lambertian : public Material
-    {
-    public:
-        Lambertian(const TexturePtr &a) : m_albedo(a)
+        long long totalSamples() const
         {
+            long long n = 0;
+            forEachPixel([&](int, int, const float *, int count)
+                         { n += count; });
+            return n;
         }
-        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
-        {
-            vec3 target = hrec.p + hrec.n + random_in_unit_sphere();
-            srec.ray = Ray(hrec.p, target - hrec.p);
-            srec.albedo = m_albedo->value(hrec.u, hrec.v, hrec.p);
-            return true;
-        };
 
     private:
-        TexturePtr m_albedo;
-    };
-
-    class Metal : public Material
-    {
-    public:
-        Metal(const TexturePtr &a, float fuzz)
-            : m_albedo(a),
-              m_fuzz(fuzz)
+        struct TileState
         {
-        }
+            std::mutex mtx;
+            bool touched = false;
+        };
 
-        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
+        float *tileRGB(int t) const { return reinterpret_cast<float *>(m_data + m_stride * t); }
+        int *tileCounts(int t) const { return reinterpret_cast<int *>(tileRGB(t) + 3 * m_tileSize * m_tileSize); }
+
+        // fn(x, y, sum, count) for every pixel, pixels of untouched tiles are zero
+        template <typename Fn>
+        void forEachPixel(Fn fn) const
         {
-            vec3 reflected = reflect(normalize(r.direction()), hrec.n);
-            reflected += m_fuzz * random_in_unit_sphere();
-            srec.ray = Ray(hrec.p, reflected);
-            srec.albedo = m_albedo->value(hrec.u, hrec.v, hrec.p);
-            return dot(srec.ray.direction(), hrec.n) > 0;
+            const float zero[3] = {0.f, 0.f, 0.f};
+            for (int t = 0; t < int(m_tiles.size()); ++t)
+            {
+                std::unique_lock<std::mutex> lock(m_tiles[t].mtx, std::defer_lock);
+                if (m_shared)
+                {
+                    lock.lock();
+                }
+                int x0 = (t % m_tilesX) * m_tileSize;
+                int y0 = (t / m_tilesX) * m_tileSize;
+                for (int y = y0; y < std::min(y0 + m_tileSize, m_height); ++y)
+                {
+                    for (int x = x0; x < std::min(x0 + m_tileSize, m_width); ++x)
+                    {
+                        int index = (y - y0) * m_tileSize + (x - x0);
+                        if (m_tiles[t].touched)
+                        {
+                            fn(x, y, tileRGB(t) + 3 * index, tileCounts(t)[index]);
+                        }
+                        else
+                        {
+                            fn(x, y, zero, 0);
+                        }
+                    }
+                }
+            }
         }
 
-    private:
-        TexturePtr m_albedo;
-        float m_fuzz;
+        int m_width;
+        int m_height;
+        int m_tileSize;
+        bool m_shared;
+        int m_tilesX;
+        size_t m_stride; // bytes per tile: sums of samples, then numbers of samples
+        char *m_data;
+        mutable std::vector<TileState> m_tiles;
     };
 
-    class Dielectric : public Material
+    // Bump allocator for per-thread temporaries of the render loop. Blocks are allocated by
+    // the thread using them, on cache line boundaries, and kept when a Scope rewinds, so
+    // once warmed up alloc() neither reaches the heap nor shares cache lines between threads.
+    class Arena
     {
     public:
-        Dielectric(float ri)
-            : m_ri(ri)
+        // rewinds everything allocated while it lives
+        class Scope
         {
-        }
-
-        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
-        {
-            vec3 outward_normal;
-            vec3 reflected = reflect(r.direction(), hrec.n);
-            float ni_over_nt;
-            float reflect_prob;
-            float cosine;
-            if (dot(r.direction(), hrec.n) > 0)
-            {
-                outward_normal = -hrec.n;
-                ni_over_nt = m_ri;
-                cosine = m_ri * dot(r.direction(), hrec.n) / length(r.direction());
-            }
-            else
+        public:
+            Scope(Arena &arena) : m_arena(arena), m_block(arena.m_block), m_offset(arena.m_offset) {}
+            ~Scope()
             {
-                outward_normal = hrec.n;
-                ni_over_nt = recip(m_ri);
-                cosine = -dot(r.direction(), hrec.n) / length(r.direction());
+                m_arena.m_block = m_block;
+                m_arena.m_offset = m_offset;
             }
 
-            srec.albedo = vec3(1);
+            template <typename T>
+            T *alloc(size_t n) { return m_arena.alloc<T>(n); }
 
-            vec3 refracted;
-            if (refract(-r.direction(), outward_normal, ni_over_nt, refracted))
-            {
-                reflect_prob = schlick(cosine, m_ri);
-            }
-            else
+        private:
+            Arena &m_arena;
+            size_t m_block;
+            size_t m_offset;
+        };
+
+        Arena() : m_block(0), m_offset(0) {}
+        Arena(const Arena &) = delete;
+        Arena &operator=(const Arena &) = delete;
+
+        ~Arena()
+        {
+            for (auto &b : m_blocks)
             {
-                reflect_prob = 1;
+                std::free(b.data);
             }
+        }
 
-            if (drand48() < reflect_prob)
+        // uninitialised storage for n T, T has to be trivially destructible
+        template <typename T>
+        T *alloc(size_t n)
+        {
+            static_assert(std::is_trivially_destructible<T>::value, "arena memory is never destroyed");
+            size_t bytes = (n * sizeof(T) + 63) & ~size_t(63);
+            while (m_block < m_blocks.size() && m_offset + bytes > m_blocks[m_block].size)
             {
-                srec.ray = Ray(hrec.p, reflected);
+                ++m_block;
+                m_offset = 0;
             }
-            else
+            if (m_block == m_blocks.size())
             {
-                srec.ray = Ray(hrec.p, refracted);
+                size_t size = std::max<size_t>(bytes, 64 * 1024);
+                m_blocks.push_back({static_cast<char *>(std::aligned_alloc(64, size)), size});
             }
-
-            return true;
+            T *p = reinterpret_cast<T *>(m_blocks[m_block].data + m_offset);
+            m_offset += bytes;
+            return p;
         }
 
     private:
-        float m_ri;
+        struct Block
+        {
+            char *data;
+            size_t size;
+        };
+
+        std::vector<Block> m_blocks;
+        size_t m_block;  // current block
+        size_t m_offset; // next free byte in it
     };
 
-    class DiffuseLight : public Material
+    inline Arena &thread_arena()
     {
-    public:
-        DiffuseLight(const TexturePtr &emit)
-            : m_emit(emit) {}
-
-        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
-        {
-            return false;
-        }
-
-        virtual vec3 emitted(const Ray &r, const HitRec &hrec) const override
-        {
-            return m_emit->value(hrec.u, hrec.v, hrec.p);
-        }
+        thread_local Arena arena;
+        return arena;
+    }
 
-    private:
-        TexturePtr m_emit;
+    struct Tile
+    {
+        int x0;
+        int y0;
+        int x1; // exclusive
+        int y1;
     };
 
-    class Shape
+    enum TileOrder
     {
-    public:
-        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const = 0;
+        kScanlineOrder = 0,
+        kMortonOrder,
+        kHilbertOrder,
+        kSpiralOrder, // from the center outwards
     };
 
-    class Sphere : public Shape
+    inline uint32_t morton2(uint32_t x, uint32_t y)
     {
-    public:
-        Sphere() {}
-        Sphere(const vec3 &c, float r, const MaterialPtr &mat)
-            : m_center(c),
-              m_radius(r),
-              m_material(mat)
+        uint32_t key = 0;
+        for (int b = 0; b < 16; ++b)
         {
+            key |= ((x >> b) & 1u) << (2 * b);
+            key |= ((y >> b) & 1u) << (2 * b + 1);
         }
+        return key;
+    }
 
-        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+    // interleaves the low 10 bits of x, y and z
+    inline uint32_t morton3(uint32_t x, uint32_t y, uint32_t z)
+    {
+        uint32_t key = 0;
+        for (int b = 0; b < 10; ++b)
         {
-            vec3 oc = r.origin() - m_center;
-            float a = dot(r.direction(), r.direction());
-            float b = 2.0 * dot(oc, r.direction());
-            float c = dot(oc, oc) - pow2(m_radius);
-            float D = b * b - 4 * a * c;
-            if (D > 0)
+            key |= ((x >> b) & 1u) << (3 * b);
+            key |= ((y >> b) & 1u) << (3 * b + 1);
+            key |= ((z >> b) & 1u) << (3 * b + 2);
+        }
+        return key;
+    }
+
+    // index of (x, y) along the Hilbert curve filling an n x n grid, n a power of two
+    inline uint32_t hilbert2(uint32_t n, uint32_t x, uint32_t y)
+    {
+        uint32_t d = 0;
+        for (uint32_t s = n / 2; s > 0; s /= 2)
+        {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            d += s * s * ((3 * rx) ^ ry);
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    inline std::vector<Tile> make_tiles(int width, int height, int size, TileOrder order = kScanlineOrder)
+    {
+        std::vector<Tile> tiles;
+        std::vector<uint64_t> keys; // integers, exact for any tile count
+        int tx = (width + size - 1) / size;
+        int ty = (height + size - 1) / size;
+        uint32_t n = 1;
+        while (n < uint32_t(std::max(tx, ty)))
+        {
+            n *= 2;
+        }
+        for (int j = 0; j < ty; ++j)
+        {
+            for (int i = 0; i < tx; ++i)
+            {
+                int x = i * size;
+                int y = j * size;
+                tiles.push_back({x, y, std::min(x + size, width), std::min(y + size, height)});
+                switch (order)
+                {
+                case kScanlineOrder:
+                    keys.push_back(tiles.size());
+                    break;
+                case kMortonOrder:
+                    keys.push_back(morton2(i, j));
+                    break;
+                case kHilbertOrder:
+                    keys.push_back(hilbert2(n, i, j));
+                    break;
+                case kSpiralOrder:
+                {
+                    // ring around the center in the high 32 bits, then the angle within the ring
+                    float dx = i + 0.5f - 0.5f * tx;
+                    float dy = j + 0.5f - 0.5f * ty;
+                    uint64_t ring = uint64_t(floorf(std::max(fabsf(dx), fabsf(dy))));
+                    float angle = (atan2f(dy, dx) + PI) * RECIP_PI; // [0, 2]
+                    keys.push_back(ring << 32 | uint32_t(angle * float(1u << 30)));
+                    break;
+                }
+                }
+            }
+        }
+        std::vector<int> index(tiles.size());
+        std::iota(index.begin(), index.end(), 0);
+        std::stable_sort(index.begin(), index.end(), [&](int a, int b)
+                         { return keys[a] < keys[b]; });
+        std::vector<Tile> ordered;
+        for (int k : index)
+        {
+            ordered.push_back(tiles[k]);
+        }
+        return ordered;
+    }
+
+    // NUMA nodes and their cpus, read from /sys; a single node with every cpu if unavailable
+    struct NumaTopology
+    {
+        std::vector<std::vector<int>> cpus; // per node
+
+        int nodes() const { return int(cpus.size()); }
+
+        int cpuCount() const
+        {
+            int n = 0;
+            for (auto &c : cpus)
+            {
+                n += int(c.size());
+            }
+            return n;
+        }
+
+        // cpu of worker i when workers are spread over the nodes round robin, and its node
+        int cpu(int worker, int &node) const
+        {
+            node = worker % nodes();
+            const std::vector<int> &c = cpus[node];
+            return c[(worker / nodes()) % c.size()];
+        }
+
+        static NumaTopology detect()
+        {
+            NumaTopology topology;
+#ifdef __linux__
+            const char *root = "/sys/devices/system/node";
+            std::vector<int> ids;
+            if (DIR *dir = opendir(root))
+            {
+                while (struct dirent *e = readdir(dir))
+                {
+                    if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9')
+                    {
+                        ids.push_back(atoi(e->d_name + 4));
+                    }
+                }
+                closedir(dir);
+            }
+            std::sort(ids.begin(), ids.end());
+            for (int id : ids)
+            {
+                std::string path = std::string(root) + "/node" + std::to_string(id) + "/cpulist";
+                FILE *f = fopen(path.c_str(), "r");
+                if (!f)
+                {
+                    continue;
+                }
+                char buf[4096] = {};
+                if (fgets(buf, sizeof(buf), f))
+                {
+                    std::vector<int> list = parse_cpulist(buf);
+                    if (!list.empty())
+                    {
+                        topology.cpus.push_back(list);
+                    }
+                }
+                fclose(f);
+            }
+#endif
+            if (topology.cpus.empty())
+            {
+                topology.cpus.resize(1);
+                for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i)
+                {
+                    topology.cpus[0].push_back(int(i));
+                }
+            }
+            return topology;
+        }
+
+        // "0-3,8,10-11"
+        static std::vector<int> parse_cpulist(const char *s)
+        {
+            std::vector<int> cpus;
+            while (*s)
+            {
+                char *end;
+                long a = strtol(s, &end, 10);
+                if (end == s)
+                {
+                    ++s;
+                    continue;
+                }
+                long b = a;
+                s = end;
+                if (*s == '-')
+                {
+                    b = strtol(s + 1, &end, 10);
+                    s = end;
+                }
+                for (long c = a; c <= b; ++c)
+                {
+                    cpus.push_back(int(c));
+                }
+            }
+            return cpus;
+        }
+    };
+
+    // restrict the calling thread to cpus
+    inline bool pin_thread(const std::vector<int> &cpus)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int c : cpus)
+        {
+            CPU_SET(c, &set);
+        }
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+
+    // Persistent workers with one task deque each. parallelFor deals the tasks round robin,
+    // so neighbouring tasks run at the same time; a worker takes tasks from the front of its
+    // own deque and steals from the back of the others once it runs dry.
+    // Given a NUMA topology, workers are spread over the nodes round robin, each pinned to one
+    // cpu, and steal from workers on their own node first.
+    class ThreadPool
+    {
+    public:
+        // threads <= 0: one per hardware thread (per cpu of the topology)
+        ThreadPool(int threads = 0, const NumaTopology *numa = nullptr)
+            : m_queues(threads > 0 ? threads : numa ? numa->cpuCount()
+                                                    : std::max(1u, std::thread::hardware_concurrency())),
+              m_fn(nullptr), m_remaining(0), m_generation(0), m_quit(false)
+        {
+            int n = int(m_queues.size());
+            m_nodes.assign(n, 0);
+            if (numa)
+            {
+                for (int i = 0; i < n; ++i)
+                {
+                    m_cpus.push_back(numa->cpu(i, m_nodes[i]));
+                }
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                std::vector<int> victims;
+                for (int pass = 0; pass < 2; ++pass)
+                {
+                    for (int k = 1; k < n; ++k)
+                    {
+                        int w = (i + k) % n;
+                        if ((m_nodes[w] == m_nodes[i]) == (pass == 0))
+                        {
+                            victims.push_back(w);
+                        }
+                    }
+                }
+                m_victims.push_back(victims);
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                m_threads.emplace_back(&ThreadPool::work, this, i);
+            }
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_quit = true;
+            }
+            m_wake.notify_all();
+            for (auto &t : m_threads)
+            {
+                t.join();
+            }
+        }
+
+        int size() const { return int(m_threads.size()); }
+        int node(int worker) const { return m_nodes[worker]; }
+
+        // run fn(task, worker) for every task in [0, count), returns when all are done
+        void parallelFor(int count, const std::function<void(int, int)> &fn)
+        {
+            if (count <= 0)
+            {
+                return;
+            }
+            std::lock_guard<std::mutex> loop(m_loopMutex);
+            m_fn = &fn;
+            m_remaining = count;
+            int n = size();
+            for (int w = 0; w < n; ++w)
+            {
+                std::lock_guard<std::mutex> lock(m_queues[w].mtx);
+                for (int k = w; k < count; k += n)
+                {
+                    m_queues[w].tasks.push_back(k);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                ++m_generation;
+            }
+            m_wake.notify_all();
+
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_done.wait(lock, [&]()
+                        { return m_remaining == 0; });
+        }
+
+    private:
+        struct Queue
+        {
+            std::mutex mtx;
+            std::deque<int> tasks;
+        };
+
+        bool pop(int worker, int &task)
+        {
+            {
+                Queue &q = m_queues[worker];
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if (!q.tasks.empty())
+                {
+                    task = q.tasks.front();
+                    q.tasks.pop_front();
+                    return true;
+                }
+            }
+            for (int victim : m_victims[worker])
+            {
+                Queue &q = m_queues[victim];
+                std::lock_guard<std::mutex> lock(q.mtx);
+                if (!q.tasks.empty())
+                {
+                    task = q.tasks.back();
+                    q.tasks.pop_back();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void work(int worker)
+        {
+            if (!m_cpus.empty())
+            {
+                pin_thread({m_cpus[worker]});
+            }
+            unsigned long long seen = 0;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(m_mtx);
+                    m_wake.wait(lock, [&]()
+                                { return m_quit || m_generation != seen; });
+                    if (m_quit)
+                    {
+                        return;
+                    }
+                    seen = m_generation;
+                }
+                int task;
+                while (pop(worker, task))
+                {
+                    (*m_fn)(task, worker);
+                    if (m_remaining.fetch_sub(1) == 1)
+                    {
+                        std::lock_guard<std::mutex> lock(m_mtx);
+                        m_done.notify_all();
+                    }
+                }
+            }
+        }
+
+        std::vector<Queue> m_queues;
+        std::vector<int> m_nodes;                // NUMA node per worker
+        std::vector<int> m_cpus;                 // cpu per worker, empty: not pinned
+        std::vector<std::vector<int>> m_victims; // steal order per worker
+        std::vector<std::thread> m_threads;
+        std::mutex m_loopMutex; // one parallelFor at a time
+        const std::function<void(int, int)> *m_fn;
+        std::atomic<int> m_remaining;
+        std::mutex m_mtx;
+        std::condition_variable m_wake;
+        std::condition_variable m_done;
+        unsigned long long m_generation;
+        bool m_quit;
+    };
+
+    // FIFO holding at most `capacity` items; push blocks while it is full,
+    // pop blocks while it is empty and returns false once it is closed and drained.
+    template <typename T>
+    class BoundedQueue
+    {
+    public:
+        BoundedQueue(size_t capacity) : m_capacity(std::max<size_t>(1, capacity)), m_closed(false) {}
+
+        void push(T item)
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_notFull.wait(lock, [&]()
+                           { return m_items.size() < m_capacity || m_closed; });
+            m_items.push_back(std::move(item));
+            m_notEmpty.notify_one();
+        }
+
+        bool pop(T &item)
+        {
+            std::unique_lock<std::mutex> lock(m_mtx);
+            m_notEmpty.wait(lock, [&]()
+                            { return !m_items.empty() || m_closed; });
+            if (m_items.empty())
+            {
+                return false;
+            }
+            item = std::move(m_items.front());
+            m_items.pop_front();
+            m_notFull.notify_one();
+            return true;
+        }
+
+        void close()
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_closed = true;
+            m_notEmpty.notify_all();
+            m_notFull.notify_all();
+        }
+
+    private:
+        size_t m_capacity;
+        bool m_closed;
+        std::deque<T> m_items;
+        std::mutex m_mtx;
+        std::condition_variable m_notEmpty;
+        std::condition_variable m_notFull;
+    };
+
+    // Encodes and writes images on a background thread, so the caller can go on rendering.
+    // write() takes the image over and only blocks while `capacity` images are waiting.
+    // The future (and the callback, called on the writer thread) reports whether the
+    // file was written. The format follows the extension: .png, .jpg, .hdr, otherwise bmp.
+    class ImageWriter
+    {
+    public:
+        typedef std::function<void(const std::string &filename, bool ok)> Callback;
+
+        ImageWriter(size_t capacity = 4) : m_jobs(capacity)
+        {
+            m_thread = std::thread(&ImageWriter::run, this);
+        }
+
+        // waits for the pending images
+        ~ImageWriter()
+        {
+            m_jobs.close();
+            m_thread.join();
+        }
+
+        std::future<bool> write(const std::string &filename, std::unique_ptr<Image> image, Callback done = nullptr)
+        {
+            Job job;
+            job.filename = filename;
+            job.width = image->width();
+            job.height = image->height();
+            job.image = std::move(image);
+            return push(std::move(job), std::move(done));
+        }
+
+        // top-down rgb floats, for .hdr
+        std::future<bool> write(const std::string &filename, int w, int h, std::vector<float> rgb, Callback done = nullptr)
+        {
+            Job job;
+            job.filename = filename;
+            job.width = w;
+            job.height = h;
+            job.hdr = std::move(rgb);
+            return push(std::move(job), std::move(done));
+        }
+
+    private:
+        struct Job
+        {
+            std::string filename;
+            int width;
+            int height;
+            std::unique_ptr<Image> image;
+            std::vector<float> hdr;
+            Callback done;
+            std::promise<bool> promise;
+        };
+
+        std::future<bool> push(Job job, Callback done)
+        {
+            job.done = std::move(done);
+            std::future<bool> result = job.promise.get_future();
+            m_jobs.push(std::move(job));
+            return result;
+        }
+
+        void run()
+        {
+            Job job;
+            while (m_jobs.pop(job))
+            {
+                bool ok = encode(job);
+                if (job.done)
+                {
+                    job.done(job.filename, ok);
+                }
+                job.promise.set_value(ok);
+            }
+        }
+
+        static bool encode(const Job &job)
+        {
+            const std::string &name = job.filename;
+            auto ext = [&](const char *e)
+            {
+                size_t n = strlen(e);
+                return name.size() >= n && name.compare(name.size() - n, n, e) == 0;
+            };
+            if (!job.image)
+            {
+                return stbi_write_hdr(name.c_str(), job.width, job.height, 3, job.hdr.data()) != 0;
+            }
+            const int comp = sizeof(Image::rgb);
+            if (ext(".png"))
+            {
+                return stbi_write_png(name.c_str(), job.width, job.height, comp, job.image->pixels(), job.width * comp) != 0;
+            }
+            if (ext(".jpg"))
+            {
+                return stbi_write_jpg(name.c_str(), job.width, job.height, comp, job.image->pixels(), 95) != 0;
+            }
+            return stbi_write_bmp(name.c_str(), job.width, job.height, comp, job.image->pixels()) != 0;
+        }
+
+        BoundedQueue<Job> m_jobs;
+        std::thread m_thread;
+    };
+
+    // Render threads only add to per-tile atomic counters when a tile is finished; a
+    // reporter thread sums them every `interval` seconds and prints throughput and ETA,
+    // either as text or as one JSON object per line.
+    class Progress
+    {
+    public:
+        // expectedSamples 0: unknown, no percentage or ETA
+        Progress(int tiles, long long expectedSamples, float interval, bool json)
+            : m_samples(tiles), m_rays(tiles), m_expected(expectedSamples),
+              m_interval(interval), m_json(json), m_finished(false)
+        {
+            m_start = std::chrono::steady_clock::now();
+            if (m_interval > 0.f)
+            {
+                m_reporter = std::thread(&Progress::report, this);
+            }
+        }
+
+        ~Progress()
+        {
+            finish();
+        }
+
+        void add(int tile, long long samples, uint64_t rays)
+        {
+            m_samples[tile].fetch_add(samples, std::memory_order_relaxed);
+            m_rays[tile].fetch_add(rays, std::memory_order_relaxed);
+        }
+
+        // stop the reporter after a last report
+        void finish()
+        {
+            if (!m_reporter.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_finished = true;
+            }
+            m_cv.notify_one();
+            m_reporter.join();
+        }
+
+    private:
+        void report()
+        {
+            auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(m_interval));
+            std::unique_lock<std::mutex> lock(m_mtx);
+            bool last = false;
+            while (!last)
+            {
+                last = m_cv.wait_for(lock, interval, [&]()
+                                     { return m_finished; });
+                long long samples = 0;
+                uint64_t rays = 0;
+                for (size_t k = 0; k < m_samples.size(); ++k)
+                {
+                    samples += m_samples[k].load(std::memory_order_relaxed);
+                    rays += m_rays[k].load(std::memory_order_relaxed);
+                }
+                float elapsed = std::chrono::duration<float>(std::chrono::steady_clock::now() - m_start).count();
+                float mrays = elapsed > 0.f ? rays / elapsed * 1e-6f : 0.f;
+                float done = m_expected > 0 ? float(samples) / m_expected : 0.f;
+                float eta = done > 0.f ? elapsed * (1.f - done) / done : -1.f;
+                if (m_json)
+                {
+                    fprintf(stderr, "{\"elapsed\": %.3f, \"samples\": %lld, \"rays\": %llu, \"mrays_per_s\": %.3f",
+                            elapsed, samples, (unsigned long long)rays, mrays);
+                    if (m_expected > 0)
+                    {
+                        fprintf(stderr, ", \"progress\": %.4f, \"eta\": %.3f", done, eta);
+                    }
+                    fprintf(stderr, ", \"done\": %s}\n", last ? "true" : "false");
+                }
+                else if (m_expected > 0)
+                {
+                    fprintf(stderr, "Rendering %5.1f%% %8.3f Mrays/s ETA %.1fs\n", 100.f * done, mrays, eta);
+                }
+                else
+                {
+                    fprintf(stderr, "Rendering %.1fs %lld samples %8.3f Mrays/s\n", elapsed, samples, mrays);
+                }
+            }
+        }
+
+        std::vector<std::atomic<long long>> m_samples; // per tile
+        std::vector<std::atomic<uint64_t>> m_rays;
+        long long m_expected;
+        float m_interval;
+        bool m_json;
+        std::chrono::steady_clock::time_point m_start;
+        std::thread m_reporter;
+        std::mutex m_mtx;
+        std::condition_variable m_cv;
+        bool m_finished;
+    };
+
+    // Hardware counters summed over all threads of the process that exist at start().
+    // Counters the kernel or the machine does not provide read as -1.
+    class PerfCounters
+    {
+    public:
+        enum Event
+        {
+            kCycles = 0,
+            kInstructions,
+            kCacheReferences,
+            kCacheMisses,
+            kL1DMisses,
+            kEventCount,
+        };
+
+        ~PerfCounters()
+        {
+            close();
+        }
+
+        void start()
+        {
+            close();
+#ifdef __linux__
+            static const uint64_t config[kEventCount] = {
+                PERF_COUNT_HW_CPU_CYCLES,
+                PERF_COUNT_HW_INSTRUCTIONS,
+                PERF_COUNT_HW_CACHE_REFERENCES,
+                PERF_COUNT_HW_CACHE_MISSES,
+                PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            };
+            DIR *dir = opendir("/proc/self/task");
+            if (!dir)
+            {
+                return;
+            }
+            while (struct dirent *e = readdir(dir))
+            {
+                int tid = atoi(e->d_name);
+                if (tid <= 0)
+                {
+                    continue;
+                }
+                for (int k = 0; k < kEventCount; ++k)
+                {
+                    perf_event_attr attr;
+                    memset(&attr, 0, sizeof(attr));
+                    attr.size = sizeof(attr);
+                    attr.type = k == kL1DMisses ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+                    attr.config = config[k];
+                    attr.exclude_kernel = 1;
+                    attr.exclude_hv = 1;
+                    int fd = int(syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+                    if (fd >= 0)
+                    {
+                        m_fds[k].push_back(fd);
+                    }
+                }
+            }
+            closedir(dir);
+#endif
+        }
+
+        // counts since start(), -1 where unavailable
+        void read(long long values[kEventCount]) const
+        {
+            for (int k = 0; k < kEventCount; ++k)
+            {
+                values[k] = m_fds[k].empty() ? -1 : 0;
+#ifdef __linux__
+                for (int fd : m_fds[k])
+                {
+                    long long v = 0;
+                    if (::read(fd, &v, sizeof(v)) == sizeof(v))
+                    {
+                        values[k] += v;
+                    }
+                }
+#endif
+            }
+        }
+
+        void print(const char *label) const
+        {
+            static const char *names[kEventCount] = {"cycles", "instructions", "cache-references", "cache-misses", "L1d-read-misses"};
+            long long values[kEventCount];
+            read(values);
+            fprintf(stderr, "%s:", label);
+            for (int k = 0; k < kEventCount; ++k)
+            {
+                if (values[k] >= 0)
+                {
+                    fprintf(stderr, " %s %lld", names[k], values[k]);
+                }
+                else
+                {
+                    fprintf(stderr, " %s n/a", names[k]);
+                }
+            }
+            fprintf(stderr, "\n");
+        }
+
+    private:
+        void close()
+        {
+            for (auto &fds : m_fds)
+            {
+#ifdef __linux__
+                for (int fd : fds)
+                {
+                    ::close(fd);
+                }
+#endif
+                fds.clear();
+            }
+        }
+
+        std::vector<int> m_fds[kEventCount];
+    };
+
+    class Ray
+    {
+    public:
+        Ray() {}
+        Ray(const vec3 &o, const vec3 &dir)
+            : m_origin(o), m_direction(dir)
+        {
+        }
+
+        const vec3 &origin() const { return m_origin; }
+        const vec3 &direction() const { return m_direction; }
+        vec3 at(float t) const { return m_origin + t * m_direction; }
+
+    private:
+        vec3 m_origin;    // 始点
+        vec3 m_direction; // 方向（非正規化）
+    };
+
+#if defined(__SSE2__)
+    // four rays in SoA layout, one per lane
+    class RayPacket
+    {
+    public:
+        RayPacket() {}
+        RayPacket(const vec3x4 &o, const vec3x4 &dir)
+            : m_origin(o), m_direction(dir)
+        {
+        }
+
+        const vec3x4 &origin() const { return m_origin; }
+        const vec3x4 &direction() const { return m_direction; }
+        Ray ray(int k) const { return Ray(lane(m_origin, k), lane(m_direction, k)); }
+
+    private:
+        vec3x4 m_origin;
+        vec3x4 m_direction;
+    };
+#endif
+
+    // a pyramid from origin bounded by four planes through it, normals pointing inwards
+    struct Frustum
+    {
+        vec3 origin;
+        vec3 normal[4];
+
+        // false if the box is certainly outside
+        bool overlaps(const vec3 &lo, const vec3 &hi) const
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                const vec3 &n = normal[k];
+                // the box corner furthest along n
+                vec3 c(n.getX() > 0.f ? hi.getX() : lo.getX(),
+                       n.getY() > 0.f ? hi.getY() : lo.getY(),
+                       n.getZ() > 0.f ? hi.getZ() : lo.getZ());
+                if (dot(n, c - origin) < 0.f)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    class Camera
+    {
+    public:
+        Camera() {}
+        Camera(const vec3 &u, const vec3 &v, const vec3 &w)
+        {
+            m_origin = vec3(0);
+            m_uvw[0] = u;
+            m_uvw[1] = v;
+            m_uvw[2] = w;
+        }
+        Camera(
+            const vec3 &lookfrom,
+            const vec3 &lookat,
+            const vec3 &vup,
+            float vfov,
+            float aspect)
+        {
+            vec3 u, v, w;
+            float halfH = tanf(radians(vfov) / 2.0f);
+            float halfW = aspect * halfH;
+            m_origin = lookfrom;
+            w = normalize(lookfrom - lookat);
+            u = normalize(cross(vup, w));
+            v = cross(w, u);
+            m_uvw[2] = m_origin - halfW * u - halfH * v - w;
+            m_uvw[0] = 2.0f * halfW * u;
+            m_uvw[1] = 2.0f * halfH * v;
+        }
+
+        Ray getRay(float u, float v) const
+        {
+            return Ray(m_origin, m_uvw[2] + m_uvw[0] * u + m_uvw[1] * v - m_origin);
+        }
+
+        // the frustum holding every ray through [u0, u1] x [v0, v1]
+        Frustum frustum(float u0, float u1, float v0, float v1) const
+        {
+            vec3 corner[4] = {getRay(u0, v0).direction(), getRay(u1, v0).direction(),
+                              getRay(u1, v1).direction(), getRay(u0, v1).direction()};
+            vec3 center = getRay(0.5f * (u0 + u1), 0.5f * (v0 + v1)).direction();
+            Frustum f;
+            f.origin = m_origin;
+            for (int k = 0; k < 4; ++k)
+            {
+                vec3 n = normalize(cross(corner[k], corner[(k + 1) % 4]));
+                f.normal[k] = dot(n, center) < 0.f ? -n : n;
+            }
+            return f;
+        }
+
+#if defined(__SSE2__)
+        // the rays through four (u, v), for 2x2 pixel packets
+        RayPacket getRays(const floatx4 &u, const floatx4 &v) const
+        {
+            vec3x4 dir = broadcast(m_uvw[2] - m_origin) + broadcast(m_uvw[0]) * u + broadcast(m_uvw[1]) * v;
+            return RayPacket(broadcast(m_origin), dir);
+        }
+#endif
+
+    private:
+        vec3 m_origin; // position of the camera
+        vec3 m_uvw[3]; // orthonormal basis vector
+    };
+
+    class HitRec
+    {
+    public:
+        float t;
+        float u;
+        float v;
+        vec3 p;
+        vec3 n;
+        const Material *mat; // owned by the shape, no reference counting per hit
+        uint32_t matId;      // index in the world's MaterialTable
+    };
+
+    class ScatterRec
+    {
+    public:
+        Ray ray;
+        vec3 albedo;
+        bool diffuse = false; // albedo / PI is the BRDF, so direct light can be sampled
+    };
+
+    // Ray queue of the wavefront integrator in SoA layout, storage from an arena scope.
+    // For extension rays `weight` is the path throughput, for shadow rays the light carried.
+    struct PathQueue
+    {
+        float *ox, *oy, *oz;
+        float *dx, *dy, *dz;
+        float *tmax;
+        float *wr, *wg, *wb;
+        int *pixel;
+        bool *countEmitted;
+        int size;
+
+        PathQueue(Arena::Scope &scope, int capacity)
+            : ox(scope.alloc<float>(capacity)), oy(scope.alloc<float>(capacity)), oz(scope.alloc<float>(capacity)),
+              dx(scope.alloc<float>(capacity)), dy(scope.alloc<float>(capacity)), dz(scope.alloc<float>(capacity)),
+              tmax(scope.alloc<float>(capacity)),
+              wr(scope.alloc<float>(capacity)), wg(scope.alloc<float>(capacity)), wb(scope.alloc<float>(capacity)),
+              pixel(scope.alloc<int>(capacity)), countEmitted(scope.alloc<bool>(capacity)), size(0)
+        {
+        }
+
+        void push(const Ray &r, float t1, const vec3 &w, int pix, bool count)
+        {
+            int k = size++;
+            ox[k] = r.origin().getX();
+            oy[k] = r.origin().getY();
+            oz[k] = r.origin().getZ();
+            dx[k] = r.direction().getX();
+            dy[k] = r.direction().getY();
+            dz[k] = r.direction().getZ();
+            tmax[k] = t1;
+            wr[k] = w.getX();
+            wg[k] = w.getY();
+            wb[k] = w.getZ();
+            pixel[k] = pix;
+            countEmitted[k] = count;
+        }
+
+        Ray ray(int k) const { return Ray(vec3(ox[k], oy[k], oz[k]), vec3(dx[k], dy[k], dz[k])); }
+        vec3 weight(int k) const { return vec3(wr[k], wg[k], wb[k]); }
+
+        // append entry k of q
+        void copy(const PathQueue &q, int k)
+        {
+            int n = size++;
+            ox[n] = q.ox[k];
+            oy[n] = q.oy[k];
+            oz[n] = q.oz[k];
+            dx[n] = q.dx[k];
+            dy[n] = q.dy[k];
+            dz[n] = q.dz[k];
+            tmax[n] = q.tmax[k];
+            wr[n] = q.wr[k];
+            wg[n] = q.wg[k];
+            wb[n] = q.wb[k];
+            pixel[n] = q.pixel[k];
+            countEmitted[n] = q.countEmitted[k];
+        }
+    };
+
+    // concrete material classes, for sorting hits by material
+    enum MaterialType
+    {
+        kLambertianMaterial = 0,
+        kMetalMaterial,
+        kDielectricMaterial,
+        kDiffuseLightMaterial,
+        kOtherMaterial,
+        kMaterialTypes,
+    };
+
+    // What a world contains, as a mask picking a specialized integrator; code for the features
+    // missing from the mask is compiled out.
+    enum SceneFeature
+    {
+        kDielectricFeature = 1 << 0,    // refracting materials
+        kEmissionFeature = 1 << 1,      // emitting materials
+        kTextureFeature = 1 << 2,       // textures other than colors
+        kLightSamplingFeature = 1 << 3, // direct light sampled from the lights
+        kGeneralFeature = 1 << 4,       // anything else: other materials, an environment map, path guiding
+        kAllFeatures = (1 << 5) - 1,
+    };
+
+    const uint32_t kNoMaterialId = 0xffffffffu; // shape not entered in a MaterialTable
+
+    class Material
+    {
+    public:
+        virtual MaterialType type() const { return kOtherMaterial; }
+        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const = 0;
+        virtual vec3 emitted(const Ray &r, const HitRec &hrec) const { return vec3(0); }
+        virtual const Texture *emission() const { return nullptr; }
+        virtual bool twoSided() const { return true; }
+    };
+
+    class Lambertian : public Material
+    {
+    public:
+        Lambertian(const TexturePtr &a) : m_albedo(a)
+        {
+        }
+        virtual MaterialType type() const override { return kLambertianMaterial; }
+        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
+        {
+            return scatter(m_albedo->value(hrec.u, hrec.v, hrec.p), hrec, srec);
+        };
+        static bool scatter(const vec3 &albedo, const HitRec &hrec, ScatterRec &srec)
+        {
+            vec3 target = hrec.p + hrec.n + random_unit_vector();
+            srec.ray = Ray(hrec.p, target - hrec.p);
+            srec.albedo = albedo;
+            srec.diffuse = true;
+            return true;
+        }
+        const Texture *albedo() const { return m_albedo.get(); }
+
+    private:
+        TexturePtr m_albedo;
+    };
+
+    class Metal : public Material
+    {
+    public:
+        Metal(const TexturePtr &a, float fuzz)
+            : m_albedo(a),
+              m_fuzz(fuzz)
+        {
+        }
+        virtual MaterialType type() const override { return kMetalMaterial; }
+
+        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
+        {
+            return scatter(m_albedo->value(hrec.u, hrec.v, hrec.p), m_fuzz, r, hrec, srec);
+        }
+        static bool scatter(const vec3 &albedo, float fuzz, const Ray &r, const HitRec &hrec, ScatterRec &srec)
+        {
+            vec3 reflected = reflect(normalize(r.direction()), hrec.n);
+            reflected += fuzz * random_in_unit_sphere();
+            srec.ray = Ray(hrec.p, reflected);
+            srec.albedo = albedo;
+            return dot(srec.ray.direction(), hrec.n) > 0;
+        }
+        const Texture *albedo() const { return m_albedo.get(); }
+        float fuzz() const { return m_fuzz; }
+
+    private:
+        TexturePtr m_albedo;
+        float m_fuzz;
+    };
+
+    class Dielectric : public Material
+    {
+    public:
+        Dielectric(float ri)
+            : m_ri(ri)
+        {
+        }
+        virtual MaterialType type() const override { return kDielectricMaterial; }
+
+        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
+        {
+            return scatter(m_ri, r, hrec, srec);
+        }
+        static bool scatter(float ri, const Ray &r, const HitRec &hrec, ScatterRec &srec)
+        {
+            vec3 outward_normal;
+            vec3 reflected = reflect(r.direction(), hrec.n);
+            float ni_over_nt;
+            float reflect_prob;
+            float cosine;
+            if (dot(r.direction(), hrec.n) > 0)
+            {
+                outward_normal = -hrec.n;
+                ni_over_nt = ri;
+                cosine = ri * dot(r.direction(), hrec.n) / length(r.direction());
+            }
+            else
+            {
+                outward_normal = hrec.n;
+                ni_over_nt = recip(ri);
+                cosine = -dot(r.direction(), hrec.n) / length(r.direction());
+            }
+
+            srec.albedo = vec3(1);
+
+            vec3 refracted;
+            if (refract(-r.direction(), outward_normal, ni_over_nt, refracted))
+            {
+                reflect_prob = schlick(cosine, ri);
+            }
+            else
+            {
+                reflect_prob = 1;
+            }
+
+            if (random_float() < reflect_prob)
+            {
+                srec.ray = Ray(hrec.p, reflected);
+            }
+            else
+            {
+                srec.ray = Ray(hrec.p, refracted);
+            }
+
+            return true;
+        }
+
+        float refractiveIndex() const { return m_ri; }
+
+    private:
+        float m_ri;
+    };
+
+    class DiffuseLight : public Material
+    {
+    public:
+        DiffuseLight(const TexturePtr &emit, bool twoSided = true)
+            : m_emit(emit), m_twoSided(twoSided) {}
+        virtual MaterialType type() const override { return kDiffuseLightMaterial; }
+
+        virtual bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const override
+        {
+            return false;
+        }
+
+        virtual vec3 emitted(const Ray &r, const HitRec &hrec) const override
+        {
+            return emits(m_twoSided, r, hrec) ? m_emit->value(hrec.u, hrec.v, hrec.p) : vec3(0);
+        }
+        // whether the hit side of the light emits
+        static bool emits(bool twoSided, const Ray &r, const HitRec &hrec)
+        {
+            return twoSided || dot(r.direction(), hrec.n) <= 0;
+        }
+
+        virtual const Texture *emission() const override { return m_emit.get(); }
+        virtual bool twoSided() const override { return m_twoSided; }
+
+    private:
+        TexturePtr m_emit;
+        bool m_twoSided;
+    };
+
+    // Texture trees flattened into one array of nodes: a value is found by a loop walking down
+    // from a root node instead of a chain of virtual calls. Constants are folded while compiling,
+    // so a checker of two colors becomes one node selecting between them, and a checker of
+    // equal colors a single color.
+    class TextureGraph
+    {
+    public:
+        // the root node of t, compiled on first use
+        int compile(const Texture *t)
+        {
+            auto found = m_roots.find(t);
+            if (found != m_roots.end())
+            {
+                return found->second;
+            }
+            Node node = {kTextureOp, -1, -1, 0.f, {vec3(0), vec3(0)}, t};
+            switch (t->type())
+            {
+            case kColorTexture:
+                node.op = kColorOp;
+                node.colors[0] = static_cast<const ColorTexture *>(t)->color();
+                break;
+            case kCheckerTexture:
+            {
+                const CheckerTexture *checker = static_cast<const CheckerTexture *>(t);
+                int odd = compile(checker->odd());
+                int even = compile(checker->even());
+                const Node &a = m_nodes[odd];
+                const Node &b = m_nodes[even];
+                if (checker->frequency() == 0.f)
+                {
+                    // all sines are 0, every point is on an even square
+                    return m_roots[t] = even;
+                }
+                if (a.op == kColorOp && b.op == kColorOp)
+                {
+                    if (allEqual(a.colors[0], b.colors[0]))
+                    {
+                        return m_roots[t] = odd;
+                    }
+                    node.op = kSelectOp;
+                    node.colors[0] = a.colors[0];
+                    node.colors[1] = b.colors[0];
+                }
+                else
+                {
+                    node.op = kCheckerOp;
+                    node.odd = odd;
+                    node.even = even;
+                }
+                node.freq = checker->frequency();
+                break;
+            }
+            case kImageTexture:
+                node.op = kImageOp;
+                break;
+            default:
+                break;
+            }
+            int id = int(m_nodes.size());
+            m_nodes.push_back(node);
+            return m_roots[t] = id;
+        }
+
+        vec3 value(int root, float u, float v, const vec3 &p) const
+        {
+            for (int id = root;;)
+            {
+                const Node &node = m_nodes[id];
+                switch (node.op)
+                {
+                case kColorOp:
+                    return node.colors[0];
+                case kSelectOp:
+                    return node.colors[CheckerTexture::sines(node.freq, p) < 0 ? 0 : 1];
+                case kCheckerOp:
+                    id = CheckerTexture::sines(node.freq, p) < 0 ? node.odd : node.even;
+                    break;
+                case kImageOp:
+                    return static_cast<const ImageTexture *>(node.texture)->ImageTexture::value(u, v, p);
+                default:
+                    return node.texture->value(u, v, p);
+                }
+            }
+        }
+
+        // Values of root at the points hits[index[0, n)] into out[index[k]], one node at a time
+        // for all of them: a checker splits index into the points on odd and on even squares.
+        void values(int root, const HitRec *hits, int *index, int n, vec3 *out) const
+        {
+            const Node &node = m_nodes[root];
+            switch (node.op)
+            {
+            case kColorOp:
+                for (int k = 0; k < n; ++k)
+                {
+                    out[index[k]] = node.colors[0];
+                }
+                break;
+            case kSelectOp:
+                for (int k = 0; k < n; ++k)
+                {
+                    out[index[k]] = node.colors[CheckerTexture::sines(node.freq, hits[index[k]].p) < 0 ? 0 : 1];
+                }
+                break;
+            case kCheckerOp:
+            {
+                int *even = std::partition(index, index + n, [&](int i)
+                                           { return CheckerTexture::sines(node.freq, hits[i].p) < 0; });
+                values(node.odd, hits, index, int(even - index), out);
+                values(node.even, hits, even, int(index + n - even), out);
+                break;
+            }
+            case kImageOp:
+                for (int k = 0; k < n; ++k)
+                {
+                    const HitRec &hrec = hits[index[k]];
+                    out[index[k]] = static_cast<const ImageTexture *>(node.texture)->ImageTexture::value(hrec.u, hrec.v, hrec.p);
+                }
+                break;
+            default:
+                for (int k = 0; k < n; ++k)
+                {
+                    const HitRec &hrec = hits[index[k]];
+                    out[index[k]] = node.texture->value(hrec.u, hrec.v, hrec.p);
+                }
+                break;
+            }
+        }
+
+        int size() const { return int(m_nodes.size()); }
+        // whether root is a single color, and which
+        bool isColor(int root) const { return m_nodes[root].op == kColorOp; }
+        const vec3 &color(int root) const { return m_nodes[root].colors[0]; }
+
+    private:
+        enum Op
+        {
+            kColorOp,   // colors[0]
+            kSelectOp,  // checker of colors[0] (odd) and colors[1] (even)
+            kCheckerOp, // checker of the nodes odd and even
+            kImageOp,   // ImageTexture, called directly
+            kTextureOp, // any other texture, called virtually
+        };
+
+        struct Node
+        {
+            Op op;
+            int odd;
+            int even;
+            float freq;
+            vec3 colors[2];
+            const Texture *texture;
+        };
+
+        static bool allEqual(const vec3 &a, const vec3 &b)
+        {
+            return a.getX() == b.getX() && a.getY() == b.getY() && a.getZ() == b.getZ();
+        }
+
+        std::vector<Node> m_nodes;
+        std::unordered_map<const Texture *, int> m_roots;
+    };
+
+    // One record per material of a world, reached by the 32-bit id in HitRec::matId. The four
+    // built-in materials are shaded from their records by a switch on the type instead of
+    // virtual calls, their textures are compiled into a TextureGraph; other materials keep going
+    // through their Material interface.
+    class MaterialTable
+    {
+    public:
+        struct Record
+        {
+            MaterialType type;
+            const Material *material;
+            int texture;            // root in the texture graph of the albedo, or emission of a light
+            float param;            // Metal: fuzz, Dielectric: refractive index
+            bool twoSided;          // DiffuseLight
+        };
+
+        // the id of m, entered on first use; kNoMaterialId for no material
+        uint32_t add(const Material *m)
+        {
+            if (!m)
+            {
+                return kNoMaterialId;
+            }
+            auto found = m_ids.find(m);
+            if (found != m_ids.end())
+            {
+                return found->second;
+            }
+            Record rec = {m->type(), m, -1, 0.f, true};
+            switch (rec.type)
+            {
+            case kLambertianMaterial:
+                rec.texture = m_textures.compile(static_cast<const Lambertian *>(m)->albedo());
+                break;
+            case kMetalMaterial:
+                rec.texture = m_textures.compile(static_cast<const Metal *>(m)->albedo());
+                rec.param = static_cast<const Metal *>(m)->fuzz();
+                break;
+            case kDielectricMaterial:
+                rec.param = static_cast<const Dielectric *>(m)->refractiveIndex();
+                break;
+            case kDiffuseLightMaterial:
+                rec.texture = m_textures.compile(m->emission());
+                rec.twoSided = m->twoSided();
+                break;
+            default:
+                break;
+            }
+            uint32_t id = uint32_t(m_records.size());
+            m_records.push_back(rec);
+            m_ids[m] = id;
+            return id;
+        }
+
+        int size() const { return int(m_records.size()); }
+        MaterialType type(uint32_t id) const { return m_records[id].type; }
+
+        // the SceneFeature bits of the materials entered
+        unsigned features() const
+        {
+            unsigned features = 0;
+            for (const Record &m : m_records)
+            {
+                switch (m.type)
+                {
+                case kDielectricMaterial:
+                    features |= kDielectricFeature;
+                    break;
+                case kDiffuseLightMaterial:
+                    features |= kEmissionFeature;
+                    break;
+                case kOtherMaterial:
+                    features |= kGeneralFeature;
+                    break;
+                default:
+                    break;
+                }
+                if (m.texture >= 0 && !m_textures.isColor(m.texture))
+                {
+                    features |= kTextureFeature;
+                }
+            }
+            return features;
+        }
+
+        // scatter and emitted for a world with the SceneFeature mask F: materials F rules out
+        // are not looked for, and without kTextureFeature every texture is read as a color
+        template <unsigned F>
+        bool scatterWith(const Ray &r, const HitRec &hrec, ScatterRec &srec) const
+        {
+            const Record &m = m_records[hrec.matId];
+            switch (m.type)
+            {
+            case kLambertianMaterial:
+                return Lambertian::scatter(texture<F>(m, hrec), hrec, srec);
+            case kMetalMaterial:
+                return Metal::scatter(texture<F>(m, hrec), m.param, r, hrec, srec);
+            case kDielectricMaterial:
+                return (F & kDielectricFeature) && Dielectric::scatter(m.param, r, hrec, srec);
+            case kDiffuseLightMaterial:
+                return false;
+            default:
+                return (F & kGeneralFeature) && hrec.mat->scatter(r, hrec, srec);
+            }
+        }
+
+        template <unsigned F>
+        vec3 emittedWith(const Ray &r, const HitRec &hrec) const
+        {
+            const Record &m = m_records[hrec.matId];
+            if ((F & kEmissionFeature) && m.type == kDiffuseLightMaterial)
+            {
+                return DiffuseLight::emits(m.twoSided, r, hrec) ? texture<F>(m, hrec) : vec3(0);
+            }
+            if ((F & kGeneralFeature) && m.type == kOtherMaterial)
+            {
+                return hrec.mat->emitted(r, hrec);
+            }
+            return vec3(0);
+        }
+
+        // Material::scatter of a hit on a material of type T, in a world with the features F
+        template <MaterialType T, unsigned F = kAllFeatures>
+        bool scatter(const Ray &r, const HitRec &hrec, ScatterRec &srec) const
+        {
+            const Record &m = m_records[hrec.matId];
+            switch (T)
+            {
+            case kLambertianMaterial:
+                return Lambertian::scatter(texture<F>(m, hrec), hrec, srec);
+            case kMetalMaterial:
+                return Metal::scatter(texture<F>(m, hrec), m.param, r, hrec, srec);
+            case kDielectricMaterial:
+                return Dielectric::scatter(m.param, r, hrec, srec);
+            case kDiffuseLightMaterial:
+                return false;
+            default:
+                return hrec.mat->scatter(r, hrec, srec);
+            }
+        }
+
+        // scatter<T> with the albedo, or emission, of the hit already looked up by textures()
+        template <MaterialType T>
+        bool scatter(const Ray &r, const HitRec &hrec, const vec3 &albedo, ScatterRec &srec) const
+        {
+            switch (T)
+            {
+            case kLambertianMaterial:
+                return Lambertian::scatter(albedo, hrec, srec);
+            case kMetalMaterial:
+                return Metal::scatter(albedo, m_records[hrec.matId].param, r, hrec, srec);
+            default:
+                return scatter<T>(r, hrec, srec);
+            }
+        }
+
+        // The texture values of the hits hits[order[0, n)], all on built-in materials, into
+        // out[order[k]]: the hits are grouped by texture into index, and each texture is
+        // evaluated for its group at once.
+        void textures(const HitRec *hits, const int *order, int n, int *index, vec3 *out) const
+        {
+            // counting sort, textures are few; slot 0 is for no texture. The counts live in the
+            // thread's arena, this runs once per bounce of every wavefront batch.
+            Arena::Scope scope(thread_arena());
+            int slots = m_textures.size() + 2;
+            int *first = scope.alloc<int>(slots);
+            int *fill = scope.alloc<int>(slots);
+            std::fill(first, first + slots, 0);
+            for (int k = 0; k < n; ++k)
+            {
+                ++first[m_records[hits[order[k]].matId].texture + 2];
+            }
+            for (int t = 1; t < slots; ++t)
+            {
+                first[t] += first[t - 1];
+            }
+            std::copy(first, first + slots - 1, fill);
+            for (int k = 0; k < n; ++k)
+            {
+                index[fill[m_records[hits[order[k]].matId].texture + 1]++] = order[k];
+            }
+            for (int t = 0; t < m_textures.size(); ++t)
+            {
+                if (first[t + 2] > first[t + 1])
+                {
+                    m_textures.values(t, hits, index + first[t + 1], first[t + 2] - first[t + 1], out);
+                }
+            }
+        }
+
+        // Material::emitted of a hit on a material of type T, in a world with the features F
+        template <MaterialType T, unsigned F = kAllFeatures>
+        vec3 emitted(const Ray &r, const HitRec &hrec) const
+        {
+            switch (T)
+            {
+            case kDiffuseLightMaterial:
+            {
+                const Record &m = m_records[hrec.matId];
+                return DiffuseLight::emits(m.twoSided, r, hrec) ? texture<F>(m, hrec) : vec3(0);
+            }
+            case kOtherMaterial:
+                return hrec.mat->emitted(r, hrec);
+            default:
+                return vec3(0);
+            }
+        }
+
+    private:
+        template <unsigned F>
+        vec3 texture(const Record &m, const HitRec &hrec) const
+        {
+            return F & kTextureFeature ? m_textures.value(m.texture, hrec.u, hrec.v, hrec.p) : m_textures.color(m.texture);
+        }
+
+        std::vector<Record> m_records;
+        std::unordered_map<const Material *, uint32_t> m_ids;
+        TextureGraph m_textures;
+    };
+
+    class Shape
+    {
+    public:
+        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const = 0;
+#if defined(__SSE2__)
+        // Nearest hits of a packet's rays within (t0, t1) per lane: shortens t1 to them and
+        // returns the lanes that hit. The default intersects the rays one by one.
+        virtual boolx4 hitPacket(const RayPacket &r, const floatx4 &t0, floatx4 &t1) const
+        {
+            bool hits[4];
+            float t[4];
+            HitRec hrec;
+            for (int k = 0; k < 4; ++k)
+            {
+                hits[k] = hit(r.ray(k), t0.get(k), t1.get(k), hrec);
+                t[k] = hits[k] ? hrec.t : t1.get(k);
+            }
+            t1 = floatx4(t[0], t[1], t[2], t[3]);
+            return boolx4(hits[0], hits[1], hits[2], hits[3]);
+        }
+#endif
+
+        // the following are used to sample shapes as area lights
+        virtual const Material *material() const { return nullptr; }
+        virtual float area() const { return 0.f; }
+        // uniformly pick a point on the surface for (r1, r2) in [0, 1)^2
+        virtual void sample(float r1, float r2, HitRec &hrec) const {}
+        virtual void bounds(vec3 &lo, vec3 &hi) const
+        {
+            lo = vec3(-FLT_MAX);
+            hi = vec3(FLT_MAX);
+        }
+        // bounding cone of the surface normals, returns its half angle
+        virtual float normalCone(vec3 &axis) const
+        {
+            axis = vec3::yAxis();
+            return PI;
+        }
+
+        // index of the material in the world's MaterialTable, copied into hit records
+        void setMaterialId(uint32_t id) { m_materialId = id; }
+
+    protected:
+        uint32_t m_materialId = kNoMaterialId;
+    };
+
+    class Sphere : public Shape
+    {
+    public:
+        Sphere() {}
+        Sphere(const vec3 &c, float r, const MaterialPtr &mat)
+            : m_center(c),
+              m_radius(r),
+              m_material(mat)
+        {
+        }
+
+        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        {
+            vec3 oc = r.origin() - m_center;
+            float a = dot(r.direction(), r.direction());
+            float b = 2.0 * dot(oc, r.direction());
+            float c = dot(oc, oc) - pow2(m_radius);
+            float D = b * b - 4 * a * c;
+            if (D > 0)
+            {
+                float root = sqrtf(D);
+                float temp = (-b - root) / (2.0f * a);
+                if (temp < t1 && temp > t0)
+                {
+                    hrec.t = temp;
+                    hrec.p = r.at(hrec.t);
+                    hrec.n = (hrec.p - m_center) / m_radius;
+                    hrec.mat = m_material.get();
+                    hrec.matId = m_materialId;
+                    get_sphere_uv(hrec.n, hrec.u, hrec.v);
+                    return true;
+                }
+                temp = (-b + root) / (2.0f * a);
+                if (temp < t1 && temp > t0)
+                {
+                    hrec.t = temp;
+                    hrec.p = r.at(hrec.t);
+                    hrec.n = (hrec.p - m_center) / m_radius;
+                    hrec.mat = m_material.get();
+                    hrec.matId = m_materialId;
+                    get_sphere_uv(hrec.n, hrec.u, hrec.v);
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+#if defined(__SSE2__)
+        virtual boolx4 hitPacket(const RayPacket &r, const floatx4 &t0, floatx4 &t1) const override
+        {
+            vec3x4 oc = r.origin() - broadcast(m_center);
+            const vec3x4 &d = r.direction();
+            floatx4 a = dot(d, d);
+            floatx4 b = 2.f * dot(oc, d);
+            floatx4 c = dot(oc, oc) - floatx4(pow2(m_radius));
+            floatx4 D = b * b - 4.f * a * c;
+            floatx4 root = sqrtx4(maxx4(D, 0.f));
+            floatx4 nearT = (-b - root) / (2.f * a);
+            floatx4 farT = (-b + root) / (2.f * a);
+            boolx4 valid = D > 0.f;
+            boolx4 nearHit = valid & (nearT < t1) & (nearT > t0);
+            boolx4 farHit = valid & !nearHit & (farT < t1) & (farT > t0);
+            boolx4 hit = nearHit | farHit;
+            t1 = select(t1, select(farT, nearT, nearHit), hit);
+            return hit;
+        }
+#endif
+
+        virtual const Material *material() const override { return m_material.get(); }
+        virtual float area() const override { return 4.f * PI * pow2(m_radius); }
+        virtual void sample(float r1, float r2, HitRec &hrec) const override
+        {
+            float z = 1.f - 2.f * r1;
+            float r = sqrtf(fmaxf(0.f, 1.f - z * z));
+            float phi = PI2 * r2;
+            hrec.n = vec3(r * cosf(phi), r * sinf(phi), z);
+            hrec.p = m_center + m_radius * hrec.n;
+            hrec.mat = m_material.get();
+            hrec.matId = m_materialId;
+            get_sphere_uv(hrec.n, hrec.u, hrec.v);
+        }
+        virtual void bounds(vec3 &lo, vec3 &hi) const override
+        {
+            lo = m_center - vec3(m_radius);
+            hi = m_center + vec3(m_radius);
+        }
+
+        const vec3 &center() const { return m_center; }
+        float radius() const { return m_radius; }
+
+    private:
+        vec3 m_center;
+        float m_radius;
+        MaterialPtr m_material;
+    };
+
+    class Rect : public Shape
+    {
+    public:
+        enum AxisType
+        {
+            kXY = 0,
+            kXZ,
+            kYZ,
+        };
+        Rect() {}
+        Rect(float x0, float x1, float y0, float y1, float k, AxisType axis, const MaterialPtr &m)
+            : m_x0(x0), m_x1(x1), m_y0(y0), m_y1(y1), m_k(k), m_axis(axis), m_material(m) {}
+
+        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        {
+            int xi, yi, zi;
+            vec3 axis;
+            switch (m_axis)
+            {
+            case kXY:
+            {
+                xi = 0;
+                yi = 1;
+                zi = 2;
+                axis = vec3::zAxis();
+                break;
+            };
+            case kXZ:
+            {
+                xi = 0;
+                yi = 2;
+                zi = 1;
+                axis = vec3::yAxis();
+                break;
+            };
+            case kYZ:
+            {
+                xi = 1;
+                yi = 2;
+                zi = 0;
+                axis = vec3::xAxis();
+                break;
+            };
+            }
+            float t = (m_k - r.origin()[zi]) / r.direction()[zi];
+            if (t < t0 || t > t1)
+            {
+                return false;
+            }
+
+            float x = r.origin()[xi] + t * r.direction()[xi];
+            float y = r.origin()[yi] + t * r.direction()[yi];
+            if (x < m_x0 || x > m_x1 || y < m_y0 || y > m_y1)
+            {
+                return false;
+            }
+
+            hrec.u = (x - m_x0) / (m_x1 - m_x0);
+            hrec.v = (y - m_y0) / (m_y1 - m_y0);
+            hrec.t = t;
+            hrec.mat = m_material.get();
+            hrec.matId = m_materialId;
+            hrec.p = r.at(t);
+            hrec.n = axis;
+            return true;
+        }
+
+#if defined(__SSE2__)
+        virtual boolx4 hitPacket(const RayPacket &r, const floatx4 &t0, floatx4 &t1) const override
+        {
+            int xi, yi, zi;
+            indices(xi, yi, zi);
+            floatx4 t = (floatx4(m_k) - r.origin()[zi]) / r.direction()[zi];
+            floatx4 x = r.origin()[xi] + t * r.direction()[xi];
+            floatx4 y = r.origin()[yi] + t * r.direction()[yi];
+            boolx4 hit = (t >= t0) & (t <= t1) & (x >= m_x0) & (x <= m_x1) & (y >= m_y0) & (y <= m_y1);
+            t1 = select(t1, t, hit);
+            return hit;
+        }
+#endif
+
+        virtual const Material *material() const override { return m_material.get(); }
+        virtual float area() const override { return (m_x1 - m_x0) * (m_y1 - m_y0); }
+        virtual void sample(float r1, float r2, HitRec &hrec) const override
+        {
+            int xi, yi, zi;
+            indices(xi, yi, zi);
+            float p[3];
+            p[xi] = mix(m_x0, m_x1, r1);
+            p[yi] = mix(m_y0, m_y1, r2);
+            p[zi] = m_k;
+            hrec.p = vec3(p[0], p[1], p[2]);
+            hrec.u = r1;
+            hrec.v = r2;
+            hrec.mat = m_material.get();
+            hrec.matId = m_materialId;
+            normalCone(hrec.n);
+        }
+        virtual void bounds(vec3 &lo, vec3 &hi) const override
+        {
+            int xi, yi, zi;
+            indices(xi, yi, zi);
+            float l[3], h[3];
+            l[xi] = m_x0;
+            h[xi] = m_x1;
+            l[yi] = m_y0;
+            h[yi] = m_y1;
+            l[zi] = h[zi] = m_k;
+            lo = vec3(l[0], l[1], l[2]);
+            hi = vec3(h[0], h[1], h[2]);
+        }
+        virtual float normalCone(vec3 &axis) const override
+        {
+            axis = m_axis == kXY ? vec3::zAxis() : m_axis == kXZ ? vec3::yAxis()
+                                                                 : vec3::xAxis();
+            return 0.f;
+        }
+
+        AxisType axis() const { return m_axis; }
+        void extent(float &x0, float &x1, float &y0, float &y1, float &k) const
+        {
+            x0 = m_x0;
+            x1 = m_x1;
+            y0 = m_y0;
+            y1 = m_y1;
+            k = m_k;
+        }
+
+    private:
+        void indices(int &xi, int &yi, int &zi) const
+        {
+            xi = m_axis == kYZ ? 1 : 0;
+            yi = m_axis == kXY ? 1 : 2;
+            zi = m_axis == kXY ? 2 : m_axis == kXZ ? 1
+                                                   : 0;
+        }
+
+        float m_x0;
+        float m_x1;
+        float m_y0;
+        float m_y1;
+        float m_k;
+        AxisType m_axis;
+        MaterialPtr m_material;
+    };
+
+    // The spheres and rects of a shape list in SoA float arrays, the rects grouped by axis;
+    // other shapes are kept as pointers. hit() tests four primitives at a time (eight with
+    // AVX2) without virtual calls and reports the nearest one by its index in the order of add().
+    // Without SSE2 every shape is kept as a pointer and tested one by one.
+    class ShapeArrays
+    {
+    public:
+        void add(const Shape *shape)
+        {
+            int index = int(m_shapes.size());
+            m_shapes.push_back(shape);
+#if defined(__SSE2__)
+            if (auto sphere = dynamic_cast<const Sphere *>(shape))
+            {
+                m_spheres.add(sphere, index);
+            }
+            else if (auto rect = dynamic_cast<const Rect *>(shape))
+            {
+                switch (rect->axis())
+                {
+                case Rect::kXY:
+                    m_rectsXY.add(rect, index);
+                    break;
+                case Rect::kXZ:
+                    m_rectsXZ.add(rect, index);
+                    break;
+                case Rect::kYZ:
+                    m_rectsYZ.add(rect, index);
+                    break;
+                }
+            }
+            else
+            {
+                m_others.push_back(index);
+            }
+#else
+            m_others.push_back(index);
+#endif
+        }
+
+        int size() const { return int(m_shapes.size()); }
+        const Shape *shape(int index) const { return m_shapes[index]; }
+
+        // index of the nearest shape r hits within (t0, t1), -1 if none; t1 becomes its distance
+        int hit(const Ray &r, float t0, float &t1) const
+        {
+            int best = -1;
+#if defined(__SSE2__)
+            m_spheres.hit(r, t0, t1, best);
+            m_rectsXY.hit(r, t0, t1, best);
+            m_rectsXZ.hit(r, t0, t1, best);
+            m_rectsYZ.hit(r, t0, t1, best);
+#endif
+            HitRec tmp;
+            for (int index : m_others)
+            {
+                if (m_shapes[index]->hit(r, t0, t1, tmp))
+                {
+                    t1 = tmp.t;
+                    best = index;
+                }
+            }
+            return best;
+        }
+
+    private:
+#if defined(__SSE2__)
+        // primitives are tested kLanes at a time: eight with AVX2 (vectormath_soa8.h), else four
+#ifdef __AVX2__
+        static const int kLanes = 8;
+        typedef floatx8 floatxn;
+        typedef boolx8 boolxn;
+        typedef vec3x8 vec3xn;
+        static floatxn sqrtxn(const floatxn &v) { return sqrtx8(v); }
+        static floatxn maxxn(const floatxn &a, const floatxn &b) { return maxx8(a, b); }
+        static vec3xn broadcastn(const vec3 &v) { return broadcast8(v); }
+        static floatxn laneIndex() { return floatx8(0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f); }
+#else
+        static const int kLanes = 4;
+        typedef floatx4 floatxn;
+        typedef boolx4 boolxn;
+        typedef vec3x4 vec3xn;
+        static floatxn sqrtxn(const floatxn &v) { return sqrtx4(v); }
+        static floatxn maxxn(const floatxn &a, const floatxn &b) { return maxx4(a, b); }
+        static vec3xn broadcastn(const vec3 &v) { return broadcast(v); }
+        static floatxn laneIndex() { return floatx4(0.f, 1.f, 2.f, 3.f); }
+#endif
+
+        // lanes of group i that hold primitives, for arrays padded to a multiple of kLanes
+        static boolxn inUse(int i, int count)
+        {
+            return laneIndex() < floatxn(float(count - i));
+        }
+
+        // keeps the nearest of the lanes that hit
+        static void closest(boolxn hit, const floatxn &t, const int *index, float &t1, int &best)
+        {
+            for (int bits = hit.bits(); bits; bits &= bits - 1)
+            {
+                int k = lowest_bit(bits);
+                if (t.get(k) < t1)
+                {
+                    t1 = t.get(k);
+                    best = index[k];
+                }
+            }
+        }
+
+        struct Spheres
+        {
+            std::vector<float> cx, cy, cz, r2;
+            std::vector<int> index;
+            int count = 0;
+
+            void add(const Sphere *sphere, int i)
+            {
+                if (count % kLanes == 0)
+                {
+                    for (auto *v : {&cx, &cy, &cz, &r2})
+                    {
+                        v->resize(count + kLanes, 0.f);
+                    }
+                    index.resize(count + kLanes, -1);
+                }
+                cx[count] = sphere->center().getX();
+                cy[count] = sphere->center().getY();
+                cz[count] = sphere->center().getZ();
+                r2[count] = pow2(sphere->radius());
+                index[count++] = i;
+            }
+
+            // same arithmetic as Sphere::hit
+            void hit(const Ray &r, float t0, float &t1, int &best) const
+            {
+                vec3xn d = broadcastn(r.direction());
+                floatxn a = floatxn(float(dot(r.direction(), r.direction())));
+                floatxn ox(float(r.origin().getX())), oy(float(r.origin().getY())), oz(float(r.origin().getZ()));
+                for (int i = 0; i < count; i += kLanes)
+                {
+                    vec3xn oc(ox - floatxn::load(&cx[i]), oy - floatxn::load(&cy[i]), oz - floatxn::load(&cz[i]));
+                    floatxn b = 2.f * dot(oc, d);
+                    floatxn c = dot(oc, oc) - floatxn::load(&r2[i]);
+                    floatxn D = b * b - 4.f * a * c;
+                    boolxn valid = (D > 0.f) & inUse(i, count);
+                    if (!any(valid))
+                    {
+                        continue;
+                    }
+                    floatxn root = sqrtxn(maxxn(D, 0.f));
+                    floatxn nearT = (-b - root) / (2.f * a);
+                    floatxn farT = (-b + root) / (2.f * a);
+                    boolxn nearHit = valid & (nearT < t1) & (nearT > t0);
+                    boolxn farHit = valid & !nearHit & (farT < t1) & (farT > t0);
+                    closest(nearHit | farHit, select(farT, nearT, nearHit), &index[i], t1, best);
+                }
+            }
+        };
+
+        // rects of one axis; X, Y are the in-plane coordinates and Z the normal, as in Rect
+        template <Rect::AxisType Axis>
+        struct Rects
+        {
+            static const int X = Axis == Rect::kYZ ? 1 : 0;
+            static const int Y = Axis == Rect::kXY ? 1 : 2;
+            static const int Z = Axis == Rect::kXY ? 2 : Axis == Rect::kXZ ? 1 : 0;
+
+            std::vector<float> x0, x1, y0, y1, k;
+            std::vector<int> index;
+            int count = 0;
+
+            void add(const Rect *rect, int i)
+            {
+                if (count % kLanes == 0)
+                {
+                    for (auto *v : {&x0, &x1, &y0, &y1, &k})
+                    {
+                        v->resize(count + kLanes, 0.f);
+                    }
+                    index.resize(count + kLanes, -1);
+                }
+                rect->extent(x0[count], x1[count], y0[count], y1[count], k[count]);
+                index[count++] = i;
+            }
+
+            // same arithmetic as Rect::hit
+            void hit(const Ray &r, float t0, float &t1, int &best) const
+            {
+                floatxn o(float(r.origin()[Z]));
+                floatxn ox(float(r.origin()[X])), dx(float(r.direction()[X]));
+                floatxn oy(float(r.origin()[Y])), dy(float(r.direction()[Y]));
+                floatxn dz(float(r.direction()[Z]));
+                for (int i = 0; i < count; i += kLanes)
+                {
+                    floatxn t = (floatxn::load(&k[i]) - o) / dz;
+                    boolxn hit = (t >= t0) & (t <= t1) & inUse(i, count);
+                    if (!any(hit))
+                    {
+                        continue;
+                    }
+                    floatxn x = ox + t * dx;
+                    floatxn y = oy + t * dy;
+                    hit = hit & (x >= floatxn::load(&x0[i])) & (x <= floatxn::load(&x1[i])) &
+                          (y >= floatxn::load(&y0[i])) & (y <= floatxn::load(&y1[i]));
+                    closest(hit, t, &index[i], t1, best);
+                }
+            }
+        };
+
+        Spheres m_spheres;
+        Rects<Rect::kXY> m_rectsXY;
+        Rects<Rect::kXZ> m_rectsXZ;
+        Rects<Rect::kYZ> m_rectsYZ;
+#endif
+        std::vector<const Shape *> m_shapes;
+        std::vector<int> m_others;
+    };
+
+#if defined(__SSE2__)
+    // Hit records of a packet's nearest hits once the nearest shape and distance of each lane
+    // are known (nearest[k] null for a miss); returns a bit per lane that hit.
+    inline int packet_records(const RayPacket &r, float t0, const floatx4 &closest, const Shape *const nearest[4],
+                              HitRec hrec[4])
+    {
+        int hits = 0;
+        for (int k = 0; k < 4; ++k)
+        {
+            // a little slack, the scalar test may round the distance differently
+            float t = closest.get(k);
+            if (nearest[k] && nearest[k]->hit(r.ray(k), t0, t + 1e-4f * (1.f + t), hrec[k]))
+            {
+                hits |= 1 << k;
+            }
+        }
+        return hits;
+    }
+#endif
+
+    class ShapeList : public Shape
+    {
+    public:
+        ShapeList() {}
+
+        void add(const ShapePtr &shape)
+        {
+            m_list.push_back(shape);
+            m_arrays.add(shape.get());
+        }
+
+        const std::vector<ShapePtr> &shapes() const { return m_list; }
+
+        virtual void bounds(vec3 &lo, vec3 &hi) const override
+        {
+            lo = vec3(FLT_MAX);
+            hi = vec3(-FLT_MAX);
+            for (auto &p : m_list)
+            {
+                vec3 l, h;
+                p->bounds(l, h);
+                lo = minPerElem(lo, l);
+                hi = maxPerElem(hi, h);
+            }
+        }
+
+        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        {
+            // find the nearest shape in the arrays, then let it fill in the record; a little
+            // slack, its own test may round the distance differently
+            float closest = t1;
+            int index = m_arrays.hit(r, t0, closest);
+            if (index < 0)
+            {
+                return false;
+            }
+            if (!m_arrays.shape(index)->hit(r, t0, closest + 1e-4f * (1.f + closest), hrec))
+            {
+                // missed by its own test after all, a ray grazing it: ask every shape
+                return hitEach(r, t0, t1, hrec);
+            }
+            hrec.t = fminf(hrec.t, t1);
+            return true;
+        }
+
+        // the nearest hit by calling every shape's hit(); also the fallback of hit()
+        bool hitEach(const Ray &r, float t0, float t1, HitRec &hrec) const
+        {
+            HitRec temp_rec;
+            bool hit_anything = false;
+            float closest_so_far = t1;
+            for (auto &p : m_list)
+            {
+                if (p->hit(r, t0, closest_so_far, temp_rec))
+                {
+                    hit_anything = true;
+                    closest_so_far = temp_rec.t;
+                    hrec = temp_rec;
+                }
+            }
+            return hit_anything;
+        }
+
+#if defined(__SSE2__)
+        using Shape::hitPacket;
+
+        // Hit records of the nearest hits of a packet's rays; returns a bit per lane that hit.
+        // The shapes are intersected four rays at a time, the records filled for the nearest only.
+        int hitPacket(const RayPacket &r, float t0, float t1, HitRec hrec[4]) const
+        {
+            floatx4 lo(t0);
+            floatx4 closest(t1);
+            const Shape *nearest[4] = {nullptr, nullptr, nullptr, nullptr};
+            for (auto &p : m_list)
+            {
+                for (int bits = p->hitPacket(r, lo, closest).bits(); bits; bits &= bits - 1)
+                {
+                    nearest[lowest_bit(bits)] = p.get();
+                }
+            }
+            return packet_records(r, t0, closest, nearest, hrec);
+        }
+#endif
+
+    private:
+        std::vector<ShapePtr> m_list;
+        ShapeArrays m_arrays;
+    };
+
+    // Shape-ray tests per second of ShapeList::hit (the arrays) and hitEach (a virtual hit()
+    // per shape) for random rays among count spheres and rects, printed for --bench-shapes.
+    // Returns false if the two disagree on any hit.
+    inline bool bench_shape_list(int count)
+    {
+        typedef std::chrono::steady_clock clock;
+        seed_random(1);
+        MaterialPtr mat = std::make_shared<Lambertian>(std::make_shared<ColorTexture>(vec3(0.5f)));
+        ShapeList list;
+        for (int k = 0; k < count; ++k)
+        {
+            vec3 c = 20.f * random_vector() - vec3(10.f);
+            float s = 0.2f + random_float();
+            if (k % 2 == 0)
+            {
+                list.add(std::make_shared<Sphere>(c, s, mat));
+            }
+            else
+            {
+                float p[3] = {c.getX(), c.getY(), c.getZ()};
+                Rect::AxisType axis = Rect::AxisType(k / 2 % 3);
+                int x = axis == Rect::kYZ ? 1 : 0;
+                int y = axis == Rect::kXY ? 1 : 2;
+                int z = 3 - x - y;
+                list.add(std::make_shared<Rect>(p[x] - s, p[x] + s, p[y] - s, p[y] + s, p[z], axis, mat));
+            }
+        }
+        std::vector<Ray> rays(1 << 14);
+        for (Ray &r : rays)
+        {
+            r = Ray(30.f * random_vector() - vec3(15.f), random_unit_vector());
+        }
+
+        int hits = 0;
+        int mismatches = 0;
+        for (const Ray &r : rays)
+        {
+            HitRec a, b;
+            bool hitA = list.hit(r, 0.001f, FLT_MAX, a);
+            bool hitB = list.hitEach(r, 0.001f, FLT_MAX, b);
+            hits += hitA;
+            mismatches += hitA != hitB || (hitA && (a.t != b.t || a.mat != b.mat));
+        }
+
+        // about 1e8 shape-ray tests each
+        int passes = std::max(1, int(1e8 / (double(rays.size()) * count)));
+        float sink = 0.f;
+        auto time = [&](bool arrays)
+        {
+            auto start = clock::now();
+            for (int pass = 0; pass < passes; ++pass)
+            {
+                for (const Ray &r : rays)
+                {
+                    HitRec hrec;
+                    if (arrays ? list.hit(r, 0.001f, FLT_MAX, hrec) : list.hitEach(r, 0.001f, FLT_MAX, hrec))
+                    {
+                        sink += hrec.t;
+                    }
+                }
+            }
+            float elapsed = std::chrono::duration<float>(clock::now() - start).count();
+            return float(passes) * rays.size() * count / elapsed * 1e-6f;
+        };
+        float each = time(false);
+        float arrays = time(true);
+        printf("shapes %d: hitEach %.0f, arrays %.0f M tests/s (%.1fx); %d of %d rays hit, %d mismatches%s\n", count,
+               each, arrays, arrays / each, hits, int(rays.size()), mismatches, sink < 0.f ? " " : "");
+        return mismatches == 0;
+    }
+
+    struct BVHNode
+    {
+        vec3 lo; // bounds
+        vec3 hi;
+        int first; // leaf: first shape, inner node: first of the two children
+        int count; // shapes in a leaf, 0 for inner nodes
+        int axis;  // inner nodes: the first child holds the smaller centers along it
+    };
+
+    // The nodes and shapes of a BVH, not owned; a BVH's own tree or a part of it culled to
+    // a frustum. Children of a node are stored next to each other.
+    class BVHView
+    {
+    public:
+        BVHView() : m_nodes(nullptr), m_shapes(nullptr) {}
+        BVHView(const BVHNode *nodes, const Shape *const *shapes) : m_nodes(nodes), m_shapes(shapes) {}
+
+        bool valid() const { return m_nodes != nullptr; }
+
+        bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const
+        {
+            vec3 inv = divPerElem(vec3(1.f), r.direction());
+            const vec3 &o = r.origin();
+            bool hit_anything = false;
+            int stack[BVH_STACK];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0)
+            {
+                const BVHNode &node = m_nodes[stack[--top]];
+                if (!overlaps(node, o, inv, t0, t1))
+                {
+                    continue;
+                }
+                if (node.count > 0)
+                {
+                    for (int k = node.first; k < node.first + node.count; ++k)
+                    {
+                        if (m_shapes[k]->hit(r, t0, t1, hrec))
+                        {
+                            hit_anything = true;
+                            t1 = hrec.t;
+                        }
+                    }
+                }
+                else
+                {
+                    // the child nearer along the ray is popped first
+                    bool back = inv[node.axis] < 0.f;
+                    stack[top++] = node.first + !back;
+                    stack[top++] = node.first + back;
+                }
+            }
+            return hit_anything;
+        }
+
+#if defined(__SSE2__)
+        // Hit records of the nearest hits of a packet's rays; returns a bit per lane that hit.
+        // A node is visited while any lane's ray overlaps it, its shapes intersected four rays
+        // at a time; children are ordered by lane 0's direction.
+        int hitPacket(const RayPacket &r, float t0, float t1, HitRec hrec[4]) const
+        {
+            const vec3x4 &o = r.origin();
+            vec3x4 inv(floatx4(1.f) / r.direction().getX(), floatx4(1.f) / r.direction().getY(),
+                         floatx4(1.f) / r.direction().getZ());
+            floatx4 lo(t0);
+            floatx4 closest(t1);
+            const Shape *nearest[4] = {nullptr, nullptr, nullptr, nullptr};
+            int stack[BVH_STACK];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0)
+            {
+                const BVHNode &node = m_nodes[stack[--top]];
+                if (!any(overlaps(node, o, inv, lo, closest)))
+                {
+                    continue;
+                }
+                if (node.count > 0)
+                {
+                    for (int k = node.first; k < node.first + node.count; ++k)
+                    {
+                        for (int bits = m_shapes[k]->hitPacket(r, lo, closest).bits(); bits; bits &= bits - 1)
+                        {
+                            nearest[lowest_bit(bits)] = m_shapes[k];
+                        }
+                    }
+                }
+                else
+                {
+                    bool back = inv[node.axis].get(0) < 0.f;
+                    stack[top++] = node.first + !back;
+                    stack[top++] = node.first + back;
+                }
+            }
+            return packet_records(r, t0, closest, nearest, hrec);
+        }
+#endif
+
+    private:
+#if defined(__SSE2__)
+        // slab test of four rays, the lanes whose ray overlaps the node within (t0, t1); like
+        // the scalar test, an empty box never overlaps and a NaN bound leaves t0/t1 as they are
+        static boolx4 overlaps(const BVHNode &node, const vec3x4 &o, const vec3x4 &inv, floatx4 t0, floatx4 t1)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                floatx4 near = (floatx4(float(node.lo[a])) - o[a]) * inv[a];
+                floatx4 far = (floatx4(float(node.hi[a])) - o[a]) * inv[a];
+                boolx4 swap = inv[a] < floatx4(0.f);
+                t0 = maxx4(select(near, far, swap), t0);
+                t1 = minx4(select(far, near, swap), t1);
+            }
+            return t0 <= t1;
+        }
+#endif
+
+        // slab test; an empty box (lo > hi) never overlaps
+        static bool overlaps(const BVHNode &node, const vec3 &o, const vec3 &inv, float t0, float t1)
+        {
+            for (int a = 0; a < 3; ++a)
+            {
+                float near = (node.lo[a] - o[a]) * inv[a];
+                float far = (node.hi[a] - o[a]) * inv[a];
+                if (inv[a] < 0.f)
+                {
+                    std::swap(near, far);
+                }
+                t0 = near > t0 ? near : t0;
+                t1 = far < t1 ? far : t1;
+                if (t1 < t0)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        const BVHNode *m_nodes;
+        const Shape *const *m_shapes;
+    };
+
+    // Bounding volume hierarchy over the shapes of a ShapeList, split at the median of the
+    // longest axis of the centroids until at most BVH_LEAF_SHAPES shapes are left.
+    class BVH : public Shape
+    {
+    public:
+        BVH(const ShapeList &list)
+        {
+            int n = int(list.shapes().size());
+            std::vector<Item> items(n);
+            for (int k = 0; k < n; ++k)
+            {
+                items[k].shape = list.shapes()[k].get();
+                items[k].shape->bounds(items[k].lo, items[k].hi);
+                items[k].center = 0.5f * (items[k].lo + items[k].hi);
+            }
+            m_nodes.reserve(2 * std::max(n, 1));
+            m_nodes.push_back(BVHNode());
+            build(0, items, 0, n);
+            for (auto &item : items)
+            {
+                m_shapes.push_back(item.shape);
+            }
+        }
+
+        BVHView view() const { return BVHView(m_nodes.data(), m_shapes.data()); }
+
+        // Copy the nodes overlapping the frustum into nodes (room for nodeCount()). A node with
+        // one child outside is replaced by the other child, so rays inside the frustum neither
+        // visit nor test the parts outside it.
+        BVHView cull(const Frustum &f, BVHNode *nodes) const
+        {
+            if (f.overlaps(m_nodes[0].lo, m_nodes[0].hi))
+            {
+                cull(f, 0, nodes, 0, 1);
+            }
+            else
+            {
+                nodes[0] = {vec3(FLT_MAX), vec3(-FLT_MAX), 0, 0, 0}; // empty, never hit
+            }
+            return BVHView(nodes, m_shapes.data());
+        }
+
+        int nodeCount() const { return int(m_nodes.size()); }
+
+        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        {
+            return view().hit(r, t0, t1, hrec);
+        }
+
+        virtual void bounds(vec3 &lo, vec3 &hi) const override
+        {
+            lo = m_nodes[0].lo;
+            hi = m_nodes[0].hi;
+        }
+
+    private:
+        struct Item
+        {
+            const Shape *shape;
+            vec3 lo;
+            vec3 hi;
+            vec3 center;
+        };
+
+        void build(int index, std::vector<Item> &items, int begin, int end)
+        {
+            vec3 lo(FLT_MAX), hi(-FLT_MAX), clo(FLT_MAX), chi(-FLT_MAX);
+            for (int k = begin; k < end; ++k)
+            {
+                lo = minPerElem(lo, items[k].lo);
+                hi = maxPerElem(hi, items[k].hi);
+                clo = minPerElem(clo, items[k].center);
+                chi = maxPerElem(chi, items[k].center);
+            }
+            // flat rects have flat boxes, a little padding keeps the slab test robust
+            m_nodes[index].lo = lo - vec3(1e-4f);
+            m_nodes[index].hi = hi + vec3(1e-4f);
+            if (end - begin <= BVH_LEAF_SHAPES)
+            {
+                m_nodes[index].first = begin;
+                m_nodes[index].count = end - begin;
+                m_nodes[index].axis = 0;
+                return;
+            }
+            vec3 extent = chi - clo;
+            int axis = extent.getX() > extent.getY() ? (extent.getX() > extent.getZ() ? 0 : 2)
+                                                     : (extent.getY() > extent.getZ() ? 1 : 2);
+            int mid = (begin + end) / 2;
+            std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end,
+                             [axis](const Item &a, const Item &b)
+                             { return a.center[axis] < b.center[axis]; });
+            int child = int(m_nodes.size());
+            m_nodes[index].first = child;
+            m_nodes[index].count = 0;
+            m_nodes[index].axis = axis;
+            m_nodes.push_back(BVHNode());
+            m_nodes.push_back(BVHNode());
+            build(child, items, begin, mid);
+            build(child + 1, items, mid, end);
+        }
+
+        // copies node `index`, which overlaps f, to out[at] and its overlapping subtree from
+        // out[next] on; returns the next free slot
+        int cull(const Frustum &f, int index, BVHNode *out, int at, int next) const
+        {
+            const BVHNode &node = m_nodes[index];
+            if (node.count == 0)
+            {
+                int c = node.first;
+                bool in0 = f.overlaps(m_nodes[c].lo, m_nodes[c].hi);
+                bool in1 = f.overlaps(m_nodes[c + 1].lo, m_nodes[c + 1].hi);
+                if (in0 != in1)
+                {
+                    return cull(f, in0 ? c : c + 1, out, at, next);
+                }
+                if (!in0)
+                {
+                    out[at] = {vec3(FLT_MAX), vec3(-FLT_MAX), 0, 0, 0};
+                    return next;
+                }
+                out[at] = node;
+                out[at].first = next;
+                next = cull(f, c, out, out[at].first, next + 2);
+                return cull(f, c + 1, out, out[at].first + 1, next);
+            }
+            out[at] = node;
+            return next;
+        }
+
+        std::vector<BVHNode> m_nodes;
+        std::vector<const Shape *> m_shapes;
+    };
+
+    // an emissive shape as seen by the light samplers
+    struct LightInfo
+    {
+        const Shape *shape;
+        vec3 lo; // bounds
+        vec3 hi;
+        vec3 axis;    // normals lie within thetaO of axis,
+        float thetaO; // and light leaves within thetaE of its normal
+        float thetaE;
+        float power;
+    };
+
+    class LightSampler
+    {
+    public:
+        virtual ~LightSampler() {}
+        // pick a light for shading point p with normal n, u in [0, 1)
+        // returns the light index (-1: no light can contribute) and its probability
+        virtual int sample(const vec3 &p, const vec3 &n, float u, float &pdf) const = 0;
+    };
+
+    class UniformLightSampler : public LightSampler
+    {
+    public:
+        UniformLightSampler(int count) : m_count(count) {}
+
+        virtual int sample(const vec3 &p, const vec3 &n, float u, float &pdf) const override
+        {
+            pdf = recip(float(m_count));
+            return std::min(int(u * m_count), m_count - 1);
+        }
+
+    private:
+        int m_count;
+    };
+
+    // Walker's alias method: O(1) selection proportional to light power,
+    // independent of the shading point
+    class AliasLightSampler : public LightSampler
+    {
+    public:
+        AliasLightSampler(const std::vector<LightInfo> &lights)
+            : m_prob(lights.size()), m_alias(lights.size()), m_pdf(lights.size())
+        {
+            int n = int(lights.size());
+            float total = 0.f;
+            for (auto &l : lights)
+            {
+                total += l.power;
+            }
+
+            // Vose's construction: pair each under-full bucket with an over-full one
+            std::vector<float> scaled(n);
+            std::vector<int> small, large;
+            for (int i = 0; i < n; ++i)
+            {
+                m_pdf[i] = lights[i].power / total;
+                scaled[i] = m_pdf[i] * n;
+                (scaled[i] < 1.f ? small : large).push_back(i);
+            }
+            while (!small.empty() && !large.empty())
+            {
+                int s = small.back();
+                small.pop_back();
+                int l = large.back();
+                m_prob[s] = scaled[s];
+                m_alias[s] = l;
+                scaled[l] -= 1.f - scaled[s];
+                if (scaled[l] < 1.f)
+                {
+                    large.pop_back();
+                    small.push_back(l);
+                }
+            }
+            // leftovers are 1 up to rounding
+            for (int i : small)
+            {
+                m_prob[i] = 1.f;
+                m_alias[i] = i;
+            }
+            for (int i : large)
+            {
+                m_prob[i] = 1.f;
+                m_alias[i] = i;
+            }
+        }
+
+        virtual int sample(const vec3 &p, const vec3 &n, float u, float &pdf) const override
+        {
+            int count = int(m_prob.size());
+            float x = u * count;
+            int i = std::min(int(x), count - 1);
+            int index = (x - i) < m_prob[i] ? i : m_alias[i];
+            pdf = m_pdf[index];
+            return index;
+        }
+
+    private:
+        std::vector<float> m_prob; // probability of keeping bucket i
+        std::vector<int> m_alias;  // otherwise take this one
+        std::vector<float> m_pdf;
+    };
+
+    // Light hierarchy (Conty Estevez and Kulla, "Importance Sampling of Many Lights
+    // with Adaptive Tree Splitting"). Each node bounds position, orientation and power
+    // of its lights; sampling descends one path choosing children by their estimated
+    // contribution to the shading point.
+    class LightBVH : public LightSampler
+    {
+    public:
+        LightBVH(const std::vector<LightInfo> &lights)
+        {
+            std::vector<int> index(lights.size());
+            std::iota(index.begin(), index.end(), 0);
+            m_nodes.reserve(2 * lights.size());
+            build(lights, index, 0, int(index.size()));
+        }
+
+        virtual int sample(const vec3 &p, const vec3 &n, float u, float &pdf) const override
+        {
+            pdf = 1.f;
+            int k = 0;
+            while (!m_nodes[k].leaf)
+            {
+                int left = k + 1;
+                int right = m_nodes[k].child;
+                float il = importance(m_nodes[left], p, n);
+                float ir = importance(m_nodes[right], p, n);
+                if (il + ir <= 0.f)
+                {
+                    return -1;
+                }
+                float pl = il / (il + ir);
+                if (u < pl)
+                {
+                    u = std::min(u / pl, 1.f - FLT_EPSILON);
+                    pdf *= pl;
+                    k = left;
+                }
+                else
+                {
+                    u = std::min((u - pl) / (1.f - pl), 1.f - FLT_EPSILON);
+                    pdf *= 1.f - pl;
+                    k = right;
+                }
+            }
+            return m_nodes[k].child;
+        }
+
+    private:
+        struct Node
+        {
+            vec3 lo = vec3(0);
+            vec3 hi = vec3(0);
+            vec3 axis = vec3(0);
+            float thetaO = 0.f;
+            float thetaE = 0.f;
+            float power = 0.f;
+            int child = -1; // leaf: light index, interior: second child (the first one is next to this node)
+            bool leaf = true;
+        };
+
+        static void merge(Node &a, const LightInfo &b)
+        {
+            a.lo = minPerElem(a.lo, b.lo);
+            a.hi = maxPerElem(a.hi, b.hi);
+            a.power += b.power;
+            a.thetaE = std::max(a.thetaE, b.thetaE);
+
+            // bounding cone of both normal cones
+            vec3 axis = b.axis;
+            float thetaO = b.thetaO;
+            if (thetaO > a.thetaO)
+            {
+                std::swap(a.axis, axis);
+                std::swap(a.thetaO, thetaO);
+            }
+            float thetaD = acosf(clamp(dot(a.axis, axis), -1.f, 1.f));
+            if (std::min(thetaD + thetaO, PI) <= a.thetaO)
+            {
+                return;
+            }
+            float theta = 0.5f * (a.thetaO + thetaD + thetaO);
+            vec3 ortho = axis - dot(a.axis, axis) * a.axis;
+            if (theta >= PI || lengthSqr(ortho) < EPSILON)
+            {
+                a.thetaO = PI;
+                return;
+            }
+            float rot = theta - a.thetaO;
+            a.axis = normalize(cosf(rot) * a.axis + sinf(rot) * normalize(ortho));
+            a.thetaO = theta;
+        }
+
+        int build(const std::vector<LightInfo> &lights, std::vector<int> &index, int begin, int end)
+        {
+            int k = int(m_nodes.size());
+            m_nodes.push_back(Node());
+            const LightInfo &first = lights[index[begin]];
+            Node node = {first.lo, first.hi, first.axis, first.thetaO, first.thetaE, first.power, index[begin], true};
+            vec3 clo = 0.5f * (first.lo + first.hi);
+            vec3 chi = clo;
+            for (int i = begin + 1; i < end; ++i)
+            {
+                const LightInfo &l = lights[index[i]];
+                merge(node, l);
+                clo = minPerElem(clo, 0.5f * (l.lo + l.hi));
+                chi = maxPerElem(chi, 0.5f * (l.lo + l.hi));
+            }
+
+            if (end - begin > 1)
+            {
+                // median split along the largest extent of the centroids
+                vec3 e = chi - clo;
+                int axis = e.getX() > e.getY() && e.getX() > e.getZ() ? 0 : e.getY() > e.getZ() ? 1
+                                                                                                  : 2;
+                int mid = (begin + end) / 2;
+                std::nth_element(index.begin() + begin, index.begin() + mid, index.begin() + end,
+                                 [&](int a, int b)
+                                 { return (lights[a].lo + lights[a].hi)[axis] < (lights[b].lo + lights[b].hi)[axis]; });
+                node.leaf = false;
+                build(lights, index, begin, mid);
+                node.child = build(lights, index, mid, end);
+            }
+            m_nodes[k] = node;
+            return k;
+        }
+
+        static float importance(const Node &node, const vec3 &p, const vec3 &n)
+        {
+            vec3 c = 0.5f * (node.lo + node.hi);
+            vec3 d = p - c;
+            float dist2 = lengthSqr(d);
+            float r2 = 0.25f * lengthSqr(node.hi - node.lo);
+            if (dist2 <= r2)
+            {
+                // inside the bounding sphere, no angle can be bounded
+                return node.power / std::max(dist2, EPSILON);
+            }
+            float dist = sqrtf(dist2);
+            vec3 w = d / dist;
+            float thetaU = asinf(sqrtf(r2 / dist2));
+
+            float theta = acosf(clamp(dot(node.axis, w), -1.f, 1.f));
+            float thetaP = std::max(0.f, theta - node.thetaO - thetaU);
+            if (thetaP >= node.thetaE)
+            {
+                return 0.f;
+            }
+
+            float thetaI = acosf(clamp(-dot(n, w), -1.f, 1.f));
+            float thetaIP = std::max(0.f, thetaI - thetaU);
+            if (thetaIP >= PI / 2.f)
+            {
+                return 0.f;
+            }
+            return node.power * cosf(thetaP) * cosf(thetaIP) / dist2;
+        }
+
+        std::vector<Node> m_nodes;
+    };
+
+    // Latitude-longitude HDR environment (+y is up). Directions are importance
+    // sampled by luminance with a marginal CDF over rows and a conditional CDF per row.
+    class EnvironmentLight
+    {
+    public:
+        EnvironmentLight(const char *name)
+        {
+            int nn;
+            m_texels = stbi_loadf(name, &m_width, &m_height, &nn, 3);
+            if (!m_texels)
+            {
+                return;
+            }
+
+            // piecewise constant density over the image, sin(theta) accounts for the mapping
+            m_conditional.resize((m_width + 1) * m_height);
+            m_marginal.resize(m_height + 1);
+            m_marginal[0] = 0.f;
+            for (int j = 0; j < m_height; ++j)
+            {
+                float sinTheta = sinf(PI * (j + 0.5f) / m_height);
+                float *cdf = &m_conditional[(m_width + 1) * j];
+                cdf[0] = 0.f;
+                for (int i = 0; i < m_width; ++i)
+                {
+                    cdf[i + 1] = cdf[i] + luminance(texel(i, j)) * sinTheta;
+                }
+                m_marginal[j + 1] = m_marginal[j] + cdf[m_width];
+            }
+        }
+
+        virtual ~EnvironmentLight()
+        {
+            stbi_image_free(m_texels);
+        }
+
+        bool valid() const { return m_texels != nullptr && m_marginal[m_height] > 0.f; }
+
+        vec3 radiance(const vec3 &d) const
+        {
+            float u, v;
+            direction_to_uv(normalize(d), u, v);
+            return texel(std::min(int(u * m_width), m_width - 1), std::min(int(v * m_height), m_height - 1));
+        }
+
+        // sample a direction for (u1, u2) in [0, 1)^2, pdf is per solid angle
+        vec3 sample(float u1, float u2, vec3 &d, float &pdf) const
+        {
+            int j = find(m_marginal.data(), m_height, u2 * m_marginal[m_height]);
+            const float *cdf = &m_conditional[(m_width + 1) * j];
+            int i = find(cdf, m_width, u1 * cdf[m_width]);
+
+            float fv = (u2 * m_marginal[m_height] - m_marginal[j]) / (m_marginal[j + 1] - m_marginal[j]);
+            float fu = (u1 * cdf[m_width] - cdf[i]) / (cdf[i + 1] - cdf[i]);
+            float u = (i + saturate(fu)) / m_width;
+            float v = (j + saturate(fv)) / m_height;
+            d = uv_to_direction(u, v);
+
+            float sinTheta = sinf(PI * v);
+            float p = (cdf[i + 1] - cdf[i]) / m_marginal[m_height] * m_width * m_height;
+            pdf = sinTheta > 0.f ? p / (2.f * PI * PI * sinTheta) : 0.f;
+            return texel(i, j);
+        }
+
+    private:
+        vec3 texel(int i, int j) const
+        {
+            const float *t = &m_texels[3 * (m_width * j + i)];
+            return vec3(t[0], t[1], t[2]);
+        }
+
+        // last bucket k with cdf[k] <= x, cdf has n + 1 entries
+        static int find(const float *cdf, int n, float x)
+        {
+            int k = int(std::upper_bound(cdf, cdf + n + 1, x) - cdf) - 1;
+            k = std::max(0, std::min(k, n - 1));
+            while (k > 0 && cdf[k + 1] <= cdf[k])
+            {
+                --k; // skip empty buckets
+            }
+            return k;
+        }
+
+        static void direction_to_uv(const vec3 &d, float &u, float &v)
+        {
+            u = (atan2f(d.getZ(), d.getX()) + PI) * RECIP_PI2;
+            v = acosf(clamp(d.getY(), -1.f, 1.f)) * RECIP_PI;
+        }
+
+        static vec3 uv_to_direction(float u, float v)
+        {
+            float phi = u * PI2 - PI;
+            float theta = v * PI;
+            return vec3(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+        }
+
+        int m_width;
+        int m_height;
+        float *m_texels;
+        std::vector<float> m_conditional; // per row: cdf with m_width + 1 entries
+        std::vector<float> m_marginal;    // cdf over rows
+    };
+
+    // Directional quadtree of path guiding over the equal-area (cos theta, phi) square.
+    // Each node keeps the energy of its four quadrants; recording is lock free.
+    class DirectionTree
+    {
+    public:
+        DirectionTree() : m_nodes(1), m_samples(0.f) {}
+
+        bool valid() const { return total() > 0.f; }
+        float samples() const { return m_samples; }
+        void scaleSamples(float s) { m_samples *= s; }
+
+        // add the incident radiance estimate `value` from unit direction d, thread safe
+        void record(const vec3 &d, float value)
+        {
+            atomic_add(m_samples, 1.f);
+            if (!(value > 0.f) || !std::isfinite(value))
+            {
+                return;
+            }
+            float x, y;
+            to_square(d, x, y);
+            int k = 0;
+            for (;;)
+            {
+                int q = quadrant(x, y);
+                atomic_add(m_nodes[k].sum[q], value);
+                if (!m_nodes[k].child[q])
+                {
+                    break;
+                }
+                k = m_nodes[k].child[q];
+            }
+        }
+
+        // draw a unit direction proportional to the recorded energy
+        vec3 sample(float u1, float u2) const
+        {
+            float x0 = 0.f, y0 = 0.f, size = 1.f;
+            int k = 0;
+            for (;;)
+            {
+                const Node &n = m_nodes[k];
+                float t = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+                float px = t > 0.f ? (n.sum[0] + n.sum[2]) / t : 0.5f;
+                int xi = u1 < px ? 0 : 1;
+                u1 = xi == 0 ? u1 / px : (u1 - px) / (1.f - px);
+                float col = n.sum[xi] + n.sum[xi + 2];
+                float py = col > 0.f ? n.sum[xi] / col : 0.5f;
+                int yi = u2 < py ? 0 : 1;
+                u2 = yi == 0 ? u2 / py : (u2 - py) / (1.f - py);
+                u1 = std::min(u1, 1.f - FLT_EPSILON);
+                u2 = std::min(u2, 1.f - FLT_EPSILON);
+
+                size *= 0.5f;
+                x0 += xi * size;
+                y0 += yi * size;
+                int q = xi + 2 * yi;
+                if (!n.child[q])
+                {
+                    return from_square(x0 + u1 * size, y0 + u2 * size);
+                }
+                k = n.child[q];
+            }
+        }
+
+        // solid angle density of sample()
+        float pdf(const vec3 &d) const
+        {
+            float x, y;
+            to_square(d, x, y);
+            float p = 1.f;
+            int k = 0;
+            for (;;)
+            {
+                const Node &n = m_nodes[k];
+                float t = n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+                if (t <= 0.f)
+                {
+                    break; // uniform below here
+                }
+                int q = quadrant(x, y);
+                p *= 4.f * n.sum[q] / t;
+                if (!n.child[q])
+                {
+                    break;
+                }
+                k = n.child[q];
+            }
+            return p * 0.25f * RECIP_PI;
+        }
+
+        // empty tree whose structure follows the energy recorded here: quadrants holding
+        // more than GUIDE_ENERGY_THRESHOLD of the total are subdivided
+        DirectionTree refined() const
+        {
+            struct Item
+            {
+                int src; // -1: leaf quadrant of this tree, its energy is split evenly
+                int dst;
+                int depth;
+                float sum[4];
+            };
+            DirectionTree out;
+            float t = total();
+            if (t <= 0.f)
+            {
+                return out;
+            }
+            std::vector<Item> stack;
+            Item root = {0, 0, 1, {}};
+            std::copy(m_nodes[0].sum, m_nodes[0].sum + 4, root.sum);
+            stack.push_back(root);
+            while (!stack.empty())
+            {
+                Item item = stack.back();
+                stack.pop_back();
+                for (int q = 0; q < 4; ++q)
+                {
+                    if (item.sum[q] / t <= GUIDE_ENERGY_THRESHOLD || item.depth >= GUIDE_MAX_DEPTH)
+                    {
+                        continue;
+                    }
+                    int child = int(out.m_nodes.size());
+                    out.m_nodes.push_back(Node());
+                    out.m_nodes[item.dst].child[q] = child;
+                    Item next = {-1, child, item.depth + 1, {}};
+                    int src = item.src >= 0 ? m_nodes[item.src].child[q] : 0;
+                    for (int c = 0; c < 4; ++c)
+                    {
+                        next.sum[c] = src ? m_nodes[src].sum[c] : 0.25f * item.sum[q];
+                    }
+                    next.src = src ? src : -1;
+                    stack.push_back(next);
+                }
+            }
+            return out;
+        }
+
+    private:
+        struct Node
+        {
+            float sum[4] = {};
+            int child[4] = {}; // 0: leaf quadrant
+        };
+
+        float total() const
+        {
+            const Node &n = m_nodes[0];
+            return n.sum[0] + n.sum[1] + n.sum[2] + n.sum[3];
+        }
+
+        // quadrant of (x, y), which is then mapped into that quadrant's unit square
+        static int quadrant(float &x, float &y)
+        {
+            int xi = x >= 0.5f ? 1 : 0;
+            int yi = y >= 0.5f ? 1 : 0;
+            x = 2.f * x - xi;
+            y = 2.f * y - yi;
+            return xi + 2 * yi;
+        }
+
+        static void to_square(const vec3 &d, float &x, float &y)
+        {
+            x = saturate(0.5f * (d.getZ() + 1.f));
+            y = saturate(atan2f(d.getY(), d.getX()) * RECIP_PI2 + 0.5f);
+        }
+
+        static vec3 from_square(float x, float y)
+        {
+            float cosTheta = 2.f * x - 1.f;
+            float sinTheta = sqrtf(std::max(0.f, 1.f - pow2(cosTheta)));
+            float phi = (y - 0.5f) * PI2;
+            return vec3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+        }
+
+        std::vector<Node> m_nodes;
+        float m_samples;
+    };
+
+    // Spatial binary tree of directional quadtrees ("Practical Path Guiding for Efficient
+    // Light-Transport Simulation", Mueller et al. 2017). Every leaf samples from what was
+    // learned in the previous iteration while recording into a refined copy.
+    class GuidingTree
+    {
+    public:
+        GuidingTree(const vec3 &lo, const vec3 &hi) : m_lo(lo), m_hi(hi)
+        {
+            m_nodes.push_back(Node());
+            m_leaves.push_back(Leaf());
+        }
+
+        int lookup(const vec3 &p) const
+        {
+            float lo[3] = {m_lo.getX(), m_lo.getY(), m_lo.getZ()};
+            float hi[3] = {m_hi.getX(), m_hi.getY(), m_hi.getZ()};
+            int k = 0;
+            int axis = 0;
+            while (m_nodes[k].child)
+            {
+                float mid = 0.5f * (lo[axis] + hi[axis]);
+                if (p[axis] < mid)
+                {
+                    hi[axis] = mid;
+                    k = m_nodes[k].child;
+                }
+                else
+                {
+                    lo[axis] = mid;
+                    k = m_nodes[k].child + 1;
+                }
+                axis = (axis + 1) % 3;
+            }
+            return m_nodes[k].leaf;
+        }
+
+        const DirectionTree &sampling(int leaf) const { return m_leaves[leaf].sampling; }
+        DirectionTree &building(int leaf) { return m_leaves[leaf].building; }
+        int leaves() const { return int(m_leaves.size()); }
+
+        // end of a training iteration of `spp` samples per pixel
+        void refine(int spp)
+        {
+            float threshold = GUIDE_SPLIT_SAMPLES * sqrtf(float(spp));
+            for (size_t k = 0; k < m_nodes.size(); ++k)
+            {
+                int leaf = m_nodes[k].leaf;
+                if (m_nodes[k].child || m_leaves[leaf].building.samples() <= threshold)
+                {
+                    continue;
+                }
+                m_leaves[leaf].building.scaleSamples(0.5f);
+                Leaf copy = m_leaves[leaf];
+                m_leaves.push_back(copy);
+                Node first = {0, leaf};
+                Node second = {0, int(m_leaves.size()) - 1};
+                m_nodes[k].child = int(m_nodes.size());
+                m_nodes.push_back(first);
+                m_nodes.push_back(second);
+            }
+            for (auto &l : m_leaves)
+            {
+                l.sampling = l.building;
+                l.building = l.sampling.refined();
+            }
+        }
+
+    private:
+        struct Node
+        {
+            int child = 0; // children are child and child + 1, split at the middle of axis depth % 3
+            int leaf = 0;
+        };
+        struct Leaf
+        {
+            DirectionTree sampling;
+            DirectionTree building;
+        };
+
+        vec3 m_lo;
+        vec3 m_hi;
+        std::vector<Node> m_nodes;
+        std::vector<Leaf> m_leaves;
+    };
+
+    enum LightSampling
+    {
+        kNoLightSampling = 0, // light is only found by scattered rays
+        kUniformLightSampling,
+        kPowerLightSampling, // alias table by power
+        kLightBVHSampling,
+    };
+
+    enum SceneType
+    {
+        kRectLightScene = 0,
+        kManyLightsScene,
+        kWindowScene, // room lit through a small opening
+    };
+
+#ifdef __linux__
+    // Distributed rendering talks over a Unix domain socket, in host byte order:
+    //   worker -> coordinator  hello: DIST_MAGIC, threads, width, height, tile size, spp (int32)
+    //   coordinator -> worker  assignment: count, then count tile indices (count 0: finished)
+    //   worker -> coordinator  per assigned tile: index (int32), rays (uint64), then the summed
+    //                          rgb (3 floats) and sample counts (int32) of its pixels, row by row
+    inline bool send_all(int fd, const void *data, size_t size)
+    {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+
+    inline bool recv_all(int fd, void *data, size_t size)
+    {
+        char *p = static_cast<char *>(data);
+        while (size > 0)
+        {
+            ssize_t n = recv(fd, p, size, 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            p += n;
+            size -= size_t(n);
+        }
+        return true;
+    }
+#endif
+
+    // A render split into tiles that can be rendered in any order and on any thread.
+    class RenderJob
+    {
+    public:
+        virtual ~RenderJob() {}
+        virtual int tiles() const = 0;
+        // node: NUMA node of the rendering thread
+        virtual void renderTile(int tile, int node) = 0;
+        // called once after every tile is rendered
+        virtual void finish(ImageWriter &writer, ImageWriter::Callback done) = 0;
+    };
+
+    // Renders jobs submitted from any thread on one shared set of persistent workers.
+    // Whenever a worker finishes a tile it takes the next tile of the highest priority job
+    // (the oldest among equals), so an interactive job overtakes a long render at the next
+    // tile boundary. Tiles seed their own random sequences, so the images do not depend on
+    // how the jobs were interleaved. The destructor waits for the submitted jobs.
+    // Scenes given the queue (Scene::setRenderQueue) render on it instead of their own pools.
+    // Given a NUMA topology, workers are spread over the nodes like ThreadPool's and tell
+    // the jobs their node.
+    class RenderQueue
+    {
+    public:
+        // threads <= 0: one per hardware thread (per cpu of the topology)
+        RenderQueue(int threads = 0, const NumaTopology *numa = nullptr) : m_sequence(0), m_quit(false)
+        {
+            int n = threads > 0 ? threads : numa ? numa->cpuCount()
+                                                  : std::max(1u, std::thread::hardware_concurrency());
+            for (int i = 0; i < n; ++i)
+            {
+                int node = 0;
+                int cpu = numa ? numa->cpu(i, node) : -1;
+                m_threads.emplace_back(&RenderQueue::work, this, cpu, node);
+            }
+        }
+
+        ~RenderQueue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                m_quit = true;
+            }
+            m_cv.notify_all();
+            for (auto &t : m_threads)
+            {
+                t.join();
+            }
+        }
+
+        // higher priority first; the result reports (and `done` is called) once the image is written
+        std::future<bool> submit(std::unique_ptr<RenderJob> job, int priority = 0, ImageWriter::Callback done = nullptr)
+        {
+            auto entry = std::make_shared<Entry>();
+            entry->job = std::move(job);
+            entry->priority = priority;
+            entry->done = std::move(done);
+            std::future<bool> result = entry->promise.get_future();
+            if (entry->job->tiles() == 0)
+            {
+                complete(entry);
+                return result;
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                entry->sequence = m_sequence++;
+                m_jobs.push_back(entry);
+            }
+            m_cv.notify_all();
+            return result;
+        }
+
+    private:
+        struct Entry
+        {
+            std::unique_ptr<RenderJob> job;
+            int priority;
+            uint64_t sequence;
+            int next = 0;     // next tile to hand out
+            int finished = 0; // tiles rendered
+            ImageWriter::Callback done;
+            std::promise<bool> promise;
+        };
+
+        // cpu < 0: not pinned
+        void work(int cpu, int node)
+        {
+            if (cpu >= 0)
+            {
+                pin_thread({cpu});
+            }
+            std::unique_lock<std::mutex> lock(m_mtx);
+            for (;;)
+            {
+                std::shared_ptr<Entry> best;
+                for (auto &e : m_jobs)
+                {
+                    if (e->next < e->job->tiles() &&
+                        (!best || e->priority > best->priority || (e->priority == best->priority && e->sequence < best->sequence)))
+                    {
+                        best = e;
+                    }
+                }
+                if (!best)
+                {
+                    if (m_quit && m_jobs.empty())
+                    {
+                        return;
+                    }
+                    m_cv.wait(lock);
+                    continue;
+                }
+                int tile = best->next++;
+                lock.unlock();
+                best->job->renderTile(tile, node);
+                lock.lock();
+                if (++best->finished == best->job->tiles())
+                {
+                    m_jobs.erase(std::find(m_jobs.begin(), m_jobs.end(), best));
+                    lock.unlock();
+                    complete(best);
+                    lock.lock();
+                    m_cv.notify_all();
+                }
+            }
+        }
+
+        void complete(const std::shared_ptr<Entry> &entry)
+        {
+            entry->job->finish(m_writer, [entry](const std::string &filename, bool ok)
+                               {
+                if (entry->done)
+                {
+                    entry->done(filename, ok);
+                }
+                entry->promise.set_value(ok); });
+        }
+
+        ImageWriter m_writer; // destroyed last, after the workers are joined
+        std::mutex m_mtx;
+        std::condition_variable m_cv;
+        std::vector<std::shared_ptr<Entry>> m_jobs;
+        uint64_t m_sequence;
+        bool m_quit;
+        std::vector<std::thread> m_threads;
+    };
+
+    // what the integrator reads while rendering; in NUMA mode every node gets its own copy
+    struct World
+    {
+        Camera camera;
+        vec3 backColor;
+        ShapeList shapes;
+        std::vector<LightInfo> lights;
+        std::unique_ptr<LightSampler> lightSampler;
+        vec3 lo; // bounds of the shapes
+        vec3 hi;
+        std::unique_ptr<BVH> bvh; // over shapes, if enabled
+        MaterialTable materials;  // of shapes, if enabled
+        unsigned features = kAllFeatures; // SceneFeature mask, if the integrator is specialized
+    };
+
+    class Scene
+    {
+    public:
+        typedef std::chrono::steady_clock clock;
+
+        Scene(int width, int height, int samples)
+            : m_image(new Image(width, height)), m_samples(samples),
+              m_sceneType(kRectLightScene), m_lightSampling(kNoLightSampling),
+              m_pathGuiding(false), m_guideTraining(false), m_guideSampling(false),
+              m_threads(0), m_tileSize(TILE_SIZE), m_tileOrder(kScanlineOrder), m_sampleParallel(false),
+              m_packets(false), m_wavefront(false), m_raySorting(false), m_bvh(false), m_frustumCulling(false),
+              m_materialTable(false), m_specialize(true), m_features(-1), m_queue(nullptr), m_queuePriority(0),
+              m_progressInterval(1.f), m_progressJson(false), m_perf(false), m_numa(false),
+              m_output("render_rect_tonemap.bmp")
+        {
+        }
+
+        void setSceneType(SceneType type) { m_sceneType = type; }
+        void setLightSampling(LightSampling mode) { m_lightSampling = mode; }
+        void setPathGuiding(bool enable) { m_pathGuiding = enable; }
+        // 0: one per hardware thread
+        void setThreads(int threads) { m_threads = threads; }
+        void setTileSize(int size) { m_tileSize = size; }
+        void setTileOrder(TileOrder order) { m_tileOrder = order; }
+        // split the samples of each tile over several tasks too, for small images on many cores
+        void setSampleParallel(bool enable) { m_sampleParallel = enable; }
+        // trace camera rays as 2x2 packets
+        void setPackets(bool enable) { m_packets = enable; }
+        // trace whole batches of paths bounce by bounce, shading the hits sorted by material
+        void setWavefront(bool enable) { m_wavefront = enable; }
+        // sort the wavefront's rays by direction and origin before every bounce after the first
+        void setRaySorting(bool enable) { m_raySorting = enable; }
+        // trace rays through a bounding volume hierarchy instead of testing every shape
+        void setBVH(bool enable) { m_bvh = enable; }
+        // trace camera rays through the BVH culled to the frustum of their tile (needs the BVH)
+        void setFrustumCulling(bool enable) { m_frustumCulling = enable; }
+        // shade the built-in materials from a table by material id instead of virtual calls; the
+        // specialized integrators always do, so this matters only for the general one
+        void setMaterialTable(bool enable) { m_materialTable = enable; }
+        // sample with an integrator compiled for just the features of the scene (see SceneFeature);
+        // on by default, off forces the general integrator
+        void setSpecialize(bool enable) { m_specialize = enable; }
+        // for measurements: SceneFeature bits the specialized integrator is compiled for on top
+        // of the scene's own, so it can only do more work (-1: just the scene's)
+        void setFeatures(int features) { m_features = features; }
+        // render() submits to the shared queue instead of the scene's own pool
+        // (nullptr: own pool); the queue has to outlive the renders
+        void setRenderQueue(RenderQueue *queue, int priority = 0)
+        {
+            m_queue = queue;
+            m_queuePriority = priority;
+        }
+        // file written by render(), the extension picks the format (.bmp, .png, .jpg)
+        void setOutput(const std::string &filename) { m_output = filename; }
+        // pin workers to the NUMA nodes and give each node its own copy of the world
+        void setNuma(bool enable)
+        {
+            m_numa = enable;
+            if (enable)
+            {
+                m_topology = NumaTopology::detect();
+            }
+        }
+        // print hardware counters and throughput after render()
+        void setPerfCounters(bool enable) { m_perf = enable; }
+        // report every `interval` seconds (0: never), as JSON lines if json is set
+        void setProgress(float interval, bool json)
+        {
+            m_progressInterval = interval;
+            m_progressJson = json;
+        }
+
+        bool loadEnvironment(const char *name)
+        {
+            m_environment = std::make_unique<EnvironmentLight>(name);
+            if (!m_environment->valid())
+            {
+                m_environment.reset();
+                return false;
+            }
+            return true;
+        }
+
+        void build()
+        {
+            m_worlds = buildWorlds(0.f);
+            if (m_worlds.size() > 1)
+            {
+                std::cerr << "NUMA: " << m_worlds.size() << " world replicas" << std::endl;
+            }
+        }
+
+        // the world at animation time [0, 1), one copy per NUMA node
+        std::vector<std::unique_ptr<World>> buildWorlds(float time)
+        {
+            int nodes = m_numa ? m_topology.nodes() : 1;
+            std::vector<std::unique_ptr<World>> worlds(nodes);
+            if (nodes == 1)
+            {
+                worlds[0] = buildWorld(time);
+                return worlds;
+            }
+            for (int n = 0; n < nodes; ++n)
+            {
+                // built by a thread running on the node, so first touch places it there
+                std::thread t([&]()
+                              {
+                    pin_thread(m_topology.cpus[n]);
+                    worlds[n] = buildWorld(time); });
+                t.join();
+            }
+            return worlds;
+        }
+
+        std::unique_ptr<World> buildWorld(float time)
+        {
+            auto world = std::make_unique<World>();
+            switch (m_sceneType)
+            {
+            case kRectLightScene:
+                buildRectLight(*world, time);
+                break;
+            case kManyLightsScene:
+                buildManyLights(*world, time);
+                break;
+            case kWindowScene:
+                buildWindow(*world, time);
+                break;
+            }
+            buildLights(*world);
+            world->shapes.bounds(world->lo, world->hi);
+            if (m_bvh)
+            {
+                world->bvh = std::make_unique<BVH>(world->shapes);
+            }
+            if (m_materialTable || m_specialize)
+            {
+                bool unlisted = false; // shapes without a material
+                for (auto &shape : world->shapes.shapes())
+                {
+                    uint32_t id = world->materials.add(shape->material());
+                    shape->setMaterialId(id);
+                    unlisted |= id == kNoMaterialId;
+                }
+                world->features = world->materials.features() | (world->lightSampler ? kLightSamplingFeature : 0) |
+                                  (unlisted ? kGeneralFeature : 0);
+            }
+            return world;
+        }
+
+        // camera looking from lookfrom to lookat with the scene's aspect ratio
+        Camera makeCamera(const vec3 &lookfrom, const vec3 &lookat, float vfov) const
+        {
+            float aspect = float(m_image->width()) / float(m_image->height());
+            return Camera(lookfrom, lookat, vec3(0, 1, 0), vfov, aspect);
+        }
+
+        // height of the bouncing sphere at animation time [0, 1), two bounces per sequence
+        static float bounce(float time)
+        {
+            return fabsf(sinf(PI2 * time));
+        }
+
+        void buildRectLight(World &world, float time)
+        {
+            // Camera
+
+            world.camera = makeCamera(vec3(13, 2, 3), vec3(0, 1, 0), 30);
+            world.backColor = vec3(0.1f);
+
+            // Shapes
+
+            world.shapes.add(std::make_shared<Sphere>(
+                vec3(0, 2 + bounce(time), 0), 2,
+                std::make_shared<Lambertian>(
+                    std::make_shared<ColorTexture>(vec3(0.5f, 0.5f, 0.5f)))));
+            world.shapes.add(std::make_shared<Sphere>(
+                vec3(0, -1000, 0), 1000,
+                std::make_shared<Lambertian>(
+                    std::make_shared<ColorTexture>(vec3(0.8f, 0.8f, 0.8f)))));
+            world.shapes.add(std::make_shared<Rect>(
+                3, 5, 1, 3, -2, Rect::kXY,
+                std::make_shared<DiffuseLight>(
+                    std::make_shared<ColorTexture>(vec3(4)))));
+        }
+
+        // thousands of small lights: glowing spheres and upward facing floor tiles
+        void buildManyLights(World &world, float time)
+        {
+            world.camera = makeCamera(vec3(13, 2, 3), vec3(0, 1, 0), 30);
+            world.backColor = vec3(0.f);
+
+            world.shapes.add(std::make_shared<Sphere>(
+                vec3(0, 2 + bounce(time), 0), 2,
+                std::make_shared<Lambertian>(
+                    std::make_shared<ColorTexture>(vec3(0.5f, 0.5f, 0.5f)))));
+            world.shapes.add(std::make_shared<Sphere>(
+                vec3(0, -1000, 0), 1000,
+                std::make_shared<Lambertian>(
+                    std::make_shared<ColorTexture>(vec3(0.8f, 0.8f, 0.8f)))));
+
+            std::mt19937 rng(1234);
+            std::uniform_real_distribution<float> uni(0.f, 1.f);
+            for (int z = -20; z < 20; ++z)
+            {
+                for (int x = -20; x < 20; ++x)
+                {
+                    vec3 c(x + 0.8f * uni(rng), 0.f, z + 0.8f * uni(rng));
+                    if (length(c) < 2.5f)
+                    {
+                        continue;
+                    }
+                    vec3 emit = (uni(rng) < 0.05f ? 40.f : 2.f) * vec3(uni(rng), uni(rng), uni(rng));
+                    if (uni(rng) < 0.6f)
+                    {
+                        float r = 0.05f + 0.1f * uni(rng);
+                        world.shapes.add(std::make_shared<Sphere>(
+                            c + vec3(0, r, 0), r,
+                            std::make_shared<DiffuseLight>(std::make_shared<ColorTexture>(emit))));
+                    }
+                    else
+                    {
+                        world.shapes.add(std::make_shared<Rect>(
+                            c.getX(), c.getX() + 0.3f, c.getZ(), c.getZ() + 0.3f, 0.01f, Rect::kXZ,
+                            std::make_shared<DiffuseLight>(std::make_shared<ColorTexture>(emit), false)));
+                    }
+                }
+            }
+        }
+
+        void buildWindow(World &world, float time)
+        {
+            world.camera = makeCamera(vec3(8.5f, 3, 9.5f), vec3(2, 2, 2), 60);
+            world.backColor = vec3(0.f);
+
+            auto white = std::make_shared<Lambertian>(std::make_shared<ColorTexture>(vec3(0.73f)));
+            auto red = std::make_shared<Lambertian>(std::make_shared<ColorTexture>(vec3(0.65f, 0.05f, 0.05f)));
+            auto light = std::make_shared<DiffuseLight>(std::make_shared<ColorTexture>(vec3(100)));
+
+            // 10 x 6 x 10 room, the wall at x = 0 has a 1 x 2 opening
+            world.shapes.add(std::make_shared<Rect>(0, 10, 0, 10, 0, Rect::kXZ, white));
+            world.shapes.add(std::make_shared<Rect>(0, 10, 0, 10, 6, Rect::kXZ, white));
+            world.shapes.add(std::make_shared<Rect>(0, 10, 0, 6, 0, Rect::kXY, white));
+            world.shapes.add(std::make_shared<Rect>(0, 10, 0, 6, 10, Rect::kXY, white));
+            world.shapes.add(std::make_shared<Rect>(0, 6, 0, 10, 10, Rect::kYZ, red));
+            world.shapes.add(std::make_shared<Rect>(0, 3, 0, 10, 0, Rect::kYZ, white));
+            world.shapes.add(std::make_shared<Rect>(4, 6, 0, 10, 0, Rect::kYZ, white));
+            world.shapes.add(std::make_shared<Rect>(3, 4, 0, 4, 0, Rect::kYZ, white));
+            world.shapes.add(std::make_shared<Rect>(3, 4, 6, 10, 0, Rect::kYZ, white));
+            world.shapes.add(std::make_shared<Sphere>(vec3(5, 1.5f + bounce(time), 5), 1.5f, white));
+
+            // sky light outside the opening
+            world.shapes.add(std::make_shared<Rect>(3.5f, 7, 2, 8, -2, Rect::kYZ, light));
+        }
+
+        void buildLights(World &world)
+        {
+            std::vector<LightInfo> &lights = world.lights;
+            for (auto &shape : world.shapes.shapes())
             {
-                float root = sqrtf(D);
-                float temp = (-b - root) / (2.0f * a);
-                if (temp < t1 && temp > t0)
+                const Material *mat = shape->material();
+                const Texture *emission = mat ? mat->emission() : nullptr;
+                if (!emission || shape->area() <= 0.f)
+                {
+                    continue;
+                }
+                LightInfo l;
+                l.shape = shape.get();
+                shape->bounds(l.lo, l.hi);
+                vec3 c = 0.5f * (l.lo + l.hi);
+                l.thetaO = mat->twoSided() ? PI : shape->normalCone(l.axis);
+                l.axis = normalize(l.axis);
+                l.thetaE = PI / 2.f;
+                l.power = luminance(emission->value(0.5f, 0.5f, c)) * shape->area() * (mat->twoSided() ? 2.f : 1.f);
+                if (l.power > 0.f)
+                {
+                    lights.push_back(l);
+                }
+            }
+            if (lights.empty())
+            {
+                return;
+            }
+
+            switch (m_lightSampling)
+            {
+            case kNoLightSampling:
+                break;
+            case kUniformLightSampling:
+                world.lightSampler = std::make_unique<UniformLightSampler>(int(lights.size()));
+                break;
+            case kPowerLightSampling:
+                world.lightSampler = std::make_unique<AliasLightSampler>(lights);
+                break;
+            case kLightBVHSampling:
+                world.lightSampler = std::make_unique<LightBVH>(lights);
+                break;
+            }
+        }
+
+        // direct light at a diffuse hit from one sampled light, without the albedo
+        vec3 sampleLight(const HitRec &hrec, const World &world) const
+        {
+            Ray shadow;
+            float t1;
+            vec3 L;
+            HitRec tmp;
+            if (!lightRay(hrec, world, shadow, t1, L) || trace(world, shadow, 0.001f, t1, tmp))
+            {
+                return vec3(0);
+            }
+            return L;
+        }
+
+        // Sample one light for a diffuse hit. Returns false if it cannot contribute, otherwise
+        // the shadow ray, its length and the light it carries if unoccluded, without the albedo.
+        bool lightRay(const HitRec &hrec, const World &world, Ray &shadow, float &t1, vec3 &L) const
+        {
+            float pdf;
+            int index = world.lightSampler->sample(hrec.p, hrec.n, random_float(), pdf);
+            if (index < 0)
+            {
+                return false;
+            }
+            const Shape *light = world.lights[index].shape;
+            HitRec lrec;
+            light->sample(random_float(), random_float(), lrec);
+
+            vec3 d = lrec.p - hrec.p;
+            float dist2 = lengthSqr(d);
+            if (dist2 <= 0.f)
+            {
+                return false;
+            }
+            float dist = sqrtf(dist2);
+            vec3 w = d / dist;
+            float cosx = dot(hrec.n, w);
+            float cosl = fabsf(dot(lrec.n, w));
+            if (cosx <= 0.f || cosl <= 0.f)
+            {
+                return false;
+            }
+
+            shadow = Ray(hrec.p, w);
+            t1 = dist * (1.f - 1e-3f);
+            vec3 Le = lrec.mat->emitted(shadow, lrec);
+            L = Le * (cosx * cosl * light->area() * RECIP_PI / (dist2 * pdf));
+            return true;
+        }
+
+        bool trace(const World &world, const Ray &r, float t0, float t1, HitRec &hrec) const
+        {
+            ++ray_count();
+            return world.bvh ? world.bvh->hit(r, t0, t1, hrec) : world.shapes.hit(r, t0, t1, hrec);
+        }
+
+        // a camera ray, through the BVH culled to its tile's frustum if there is one
+        bool trace(const World &world, const BVHView &primary, const Ray &r, float t0, float t1, HitRec &hrec) const
+        {
+            if (!primary.valid())
+            {
+                return trace(world, r, t0, t1, hrec);
+            }
+            ++ray_count();
+            return primary.hit(r, t0, t1, hrec);
+        }
+
+        // the part of the BVH inside the frustum of tile's camera rays, nodes from scope;
+        // not valid unless frustum culling is on
+        BVHView primaryView(const World &world, const Tile &tile, Arena::Scope &scope) const
+        {
+            if (!m_frustumCulling || !world.bvh)
+            {
+                return BVHView();
+            }
+            float nx = float(m_image->width());
+            float ny = float(m_image->height());
+            Frustum f = world.camera.frustum(tile.x0 / nx, tile.x1 / nx, tile.y0 / ny, tile.y1 / ny);
+            return world.bvh->cull(f, scope.alloc<BVHNode>(world.bvh->nodeCount()));
+        }
+
+#if defined(__SSE2__)
+        // trace four camera rays at once, through the BVH (culled to the tile's frustum if there
+        // is one) when it is on; returns a bit per lane that hit
+        int tracePacket(const World &world, const BVHView &primary, const RayPacket &r, float t0, float t1,
+                        HitRec hrec[4]) const
+        {
+            ray_count() += 4;
+            if (primary.valid())
+            {
+                return primary.hitPacket(r, t0, t1, hrec);
+            }
+            return world.bvh ? world.bvh->view().hitPacket(r, t0, t1, hrec) : world.shapes.hitPacket(r, t0, t1, hrec);
+        }
+#endif
+
+        // all sampled direct light at a diffuse hit, without the albedo
+        template <unsigned F = kAllFeatures>
+        vec3 directLight(const HitRec &hrec, const World &world) const
+        {
+            vec3 direct(0);
+            if (lightSampling<F>(world))
+            {
+                direct += sampleLight(hrec, world);
+            }
+            if (environment<F>())
+            {
+                direct += sampleEnvironment(hrec, world);
+            }
+            return direct;
+        }
+
+        // light arriving at a diffuse hit, without the albedo. The indirect part follows a
+        // direction drawn from a one-sample mixture of the cosine and the guiding distribution,
+        // and is recorded into the guiding tree while training.
+        vec3 guidedDiffuse(const HitRec &hrec, const World &world, int depth) const
+        {
+            bool nee = world.lightSampler || m_environment;
+            vec3 direct = directLight(hrec, world);
+
+            int leaf = m_guide->lookup(hrec.p);
+            const DirectionTree &dtree = m_guide->sampling(leaf);
+            float alpha = m_guideSampling && dtree.valid() ? GUIDE_FRACTION : 0.f;
+            vec3 w = random_float() < alpha ? dtree.sample(random_float(), random_float()) : random_cosine_direction(hrec.n);
+            float cosx = dot(hrec.n, w);
+            if (cosx <= 0.f)
+            {
+                return direct;
+            }
+            float pdf = alpha * dtree.pdf(w) + (1.f - alpha) * cosx * RECIP_PI;
+            vec3 Li = color(Ray(hrec.p, w), world, depth + 1, !nee);
+            if (m_guideTraining)
+            {
+                m_guide->building(leaf).record(w, luminance(Li) / pdf);
+            }
+            return direct + Li * (cosx * RECIP_PI / pdf);
+        }
+
+        // direct light from the environment at a diffuse hit, without the albedo
+        vec3 sampleEnvironment(const HitRec &hrec, const World &world) const
+        {
+            Ray shadow;
+            vec3 L;
+            HitRec tmp;
+            if (!environmentRay(hrec, shadow, L) || trace(world, shadow, 0.001f, FLT_MAX, tmp))
+            {
+                return vec3(0);
+            }
+            return L;
+        }
+
+        // like lightRay, for a direction sampled from the environment; the shadow ray is unbounded
+        bool environmentRay(const HitRec &hrec, Ray &shadow, vec3 &L) const
+        {
+            vec3 w;
+            float pdf;
+            vec3 Le = m_environment->sample(random_float(), random_float(), w, pdf);
+            float cosx = dot(hrec.n, w);
+            if (cosx <= 0.f || pdf <= 0.f)
+            {
+                return false;
+            }
+            shadow = Ray(hrec.p, w);
+            L = Le * (cosx * RECIP_PI / pdf);
+            return true;
+        }
+
+        // The SceneFeature mask of the integrator for world: its own features, plus the general
+        // ones the settings need; all features unless the integrator is specialized.
+        unsigned features(const World &world) const
+        {
+            if (!m_specialize)
+            {
+                return kAllFeatures;
+            }
+            unsigned features = world.features;
+            if (m_environment || m_guide)
+            {
+                features |= kGeneralFeature;
+            }
+            if (m_features >= 0)
+            {
+                features |= unsigned(m_features) & kAllFeatures;
+            }
+            return features & kGeneralFeature ? unsigned(kAllFeatures) : features;
+        }
+
+        // world.lightSampler and m_environment, constant in the specialized integrators
+        template <unsigned F>
+        static bool lightSampling(const World &world)
+        {
+            return F & kGeneralFeature ? world.lightSampler != nullptr : (F & kLightSamplingFeature) != 0;
+        }
+        template <unsigned F>
+        bool environment() const
+        {
+            return (F & kGeneralFeature) && m_environment;
+        }
+
+        // Radiance along r. The integrator functions taking a SceneFeature mask F are compiled
+        // once per mask and leave out what a world without the other features never needs.
+        // countEmitted is false after a bounce whose direct light was already sampled.
+        template <unsigned F = kAllFeatures>
+        vec3 color(const rayt::Ray &r, const World &world, int depth, bool countEmitted = true) const
+        {
+            HitRec hrec;
+            if (trace(world, r, 0.001f, FLT_MAX, hrec))
+            {
+                return shade<F>(r, hrec, world, depth, countEmitted);
+            }
+            return miss<F>(r, world, countEmitted);
+        }
+
+        // radiance leaving hrec towards the origin of r
+        template <unsigned F = kAllFeatures>
+        vec3 shade(const rayt::Ray &r, const HitRec &hrec, const World &world, int depth, bool countEmitted) const
+        {
+            // the specialized integrators shade every hit from the material table
+            bool table = F & kGeneralFeature ? m_materialTable && hrec.matId != kNoMaterialId : true;
+            bool lights = lightSampling<F>(world);
+            vec3 emitted(0);
+            if ((F & kEmissionFeature) && (countEmitted || !lights))
+            {
+                emitted = table ? world.materials.emittedWith<F>(r, hrec) : hrec.mat->emitted(r, hrec);
+            }
+            ScatterRec srec;
+            if (depth < MAX_DEPTH && (table ? world.materials.scatterWith<F>(r, hrec, srec) : hrec.mat->scatter(r, hrec, srec)))
+            {
+                if ((F & kGeneralFeature) && srec.diffuse && m_guide)
+                {
+                    return emitted + mulPerElem(srec.albedo, guidedDiffuse(hrec, world, depth));
+                }
+                if (srec.diffuse && (lights || environment<F>()))
+                {
+                    vec3 direct = directLight<F>(hrec, world);
+                    return emitted + mulPerElem(srec.albedo, direct + color<F>(srec.ray, world, depth + 1, false));
+                }
+                return emitted + mulPerElem(srec.albedo, color<F>(srec.ray, world, depth + 1));
+            }
+            return emitted;
+        }
+
+        // radiance of a ray that leaves the scene
+        template <unsigned F = kAllFeatures>
+        vec3 miss(const rayt::Ray &r, const World &world, bool countEmitted) const
+        {
+            if (!(F & kGeneralFeature))
+            {
+                return world.backColor;
+            }
+            if (!countEmitted && m_environment)
+            {
+                return vec3(0);
+            }
+            return background(world, r.direction());
+        }
+
+        vec3 background(const World &world, const vec3 &d) const
+        {
+            if (m_environment)
+            {
+                return m_environment->radiance(d);
+            }
+            return world.backColor;
+        }
+
+        vec3 backgroundSky(const vec3 &d) const
+        {
+            vec3 v = normalize(d);
+            float t = 0.5f * (v.getY() + 1.0f);
+            return lerp(t, vec3(1), vec3(0.5f, 0.7f, 1.0f));
+        }
+
+#if defined(__SSE2__)
+        // Sums of `samples` radiance samples for the 2x2 pixels (i, j), (i + 1, j), (i, j + 1)
+        // and (i + 1, j + 1). Camera rays are traced as packets, the paths go on one by one.
+        template <unsigned F = kAllFeatures>
+        void samplePacket(const World &world, const BVHView &primary, int i, int j, int samples, vec3 c[4]) const
+        {
+            int nx = m_image->width();
+            int ny = m_image->height();
+            floatx4 x = floatx4(float(i), float(i + 1), float(i), float(i + 1));
+            floatx4 y = floatx4(float(j), float(j), float(j + 1), float(j + 1));
+            floatx4 rx(1.f / nx);
+            floatx4 ry(1.f / ny);
+            for (int k = 0; k < 4; ++k)
+            {
+                c[k] = vec3(0);
+            }
+            for (int s = 0; s < samples; ++s)
+            {
+                float du[4], dv[4];
+                for (int k = 0; k < 4; ++k)
+                {
+                    du[k] = random_float();
+                    dv[k] = random_float();
+                }
+                floatx4 u = (x + floatx4(du[0], du[1], du[2], du[3])) * rx;
+                floatx4 v = (y + floatx4(dv[0], dv[1], dv[2], dv[3])) * ry;
+                RayPacket rays = world.camera.getRays(u, v);
+                HitRec hrec[4];
+                int hits = tracePacket(world, primary, rays, 0.001f, FLT_MAX, hrec);
+                for (int k = 0; k < 4; ++k)
+                {
+                    Ray r = rays.ray(k);
+                    c[k] += (hits >> k) & 1 ? shade<F>(r, hrec[k], world, 0, true) : miss<F>(r, world, true);
+                }
+            }
+        }
+#endif
+
+        // Call fn(std::integral_constant<unsigned, F>()) for the feature mask F == features,
+        // so fn can run the integrator specialized to it: kAllFeatures directly, the masks
+        // without kGeneralFeature through a table of instantiations indexed by mask.
+        template <typename Fn>
+        static void withFeatures(unsigned features, Fn &&fn)
+        {
+            if (features == kAllFeatures)
+            {
+                fn(std::integral_constant<unsigned, kAllFeatures>());
+                return;
+            }
+            withFeatures(features, fn, std::make_integer_sequence<unsigned, kGeneralFeature>());
+        }
+
+        template <typename Fn, unsigned... F>
+        static void withFeatures(unsigned features, Fn &fn, std::integer_sequence<unsigned, F...>)
+        {
+            typedef void (*Call)(Fn &);
+            static const Call calls[] = {[](Fn &f)
+                                         { f(std::integral_constant<unsigned, F>()); }...};
+            calls[features](fn);
+        }
+
+        // Sums of `samples` samples for `rows` (1 or 2) rows of tile starting at row j, row by
+        // row; two rows go through 2x2 packets when packets are on (SSE2 only). Sampled by the integrator
+        // specialized to the features of world.
+        void sampleRows(const World &world, const BVHView &primary, const Tile &tile, int j, int rows, int samples,
+                        float *rgb) const
+        {
+            withFeatures(features(world), [&](auto f)
+                         { sampleRows<decltype(f)::value>(world, primary, tile, j, rows, samples, rgb); });
+        }
+
+        template <unsigned F>
+        void sampleRows(const World &world, const BVHView &primary, const Tile &tile, int j, int rows, int samples,
+                        float *rgb) const
+        {
+            int w = tile.x1 - tile.x0;
+            int i = tile.x0;
+#if defined(__SSE2__)
+            if (rows == 2)
+            {
+                for (; i + 1 < tile.x1; i += 2)
+                {
+                    vec3 c[4];
+                    samplePacket<F>(world, primary, i, j, samples, c);
+                    float *p[4] = {rgb + 3 * (i - tile.x0), rgb + 3 * (i + 1 - tile.x0),
+                                   rgb + 3 * (w + i - tile.x0), rgb + 3 * (w + i + 1 - tile.x0)};
+                    for (int k = 0; k < 4; ++k)
+                    {
+                        p[k][0] = c[k].getX();
+                        p[k][1] = c[k].getY();
+                        p[k][2] = c[k].getZ();
+                    }
+                }
+            }
+#endif
+            for (int row = 0; row < rows; ++row)
+            {
+                for (int x = i; x < tile.x1; ++x)
+                {
+                    vec3 c = sample<F>(world, x, j + row, samples, primary);
+                    float *p = rgb + 3 * (w * row + x - tile.x0);
+                    p[0] = c.getX();
+                    p[1] = c.getY();
+                    p[2] = c.getZ();
+                }
+            }
+        }
+
+        // sum of `samples` radiance samples for pixel (i, j)
+        template <unsigned F = kAllFeatures>
+        vec3 sample(const World &world, int i, int j, int samples, const BVHView &primary = BVHView()) const
+        {
+            int nx = m_image->width();
+            int ny = m_image->height();
+            vec3 c(0);
+            for (int s = 0; s < samples; ++s)
+            {
+                float u = float(i + random_float()) / float(nx);
+                float v = float(j + random_float()) / float(ny);
+                Ray r = world.camera.getRay(u, v);
+                HitRec hrec;
+                c += trace(world, primary, r, 0.001f, FLT_MAX, hrec) ? shade<F>(r, hrec, world, 0, true) : miss<F>(r, world, true);
+            }
+            return c;
+        }
+
+        // Render the image and hand it to the background writer; the result reports
+        // (and `done` is called) once the file is written.
+        std::future<bool> render(ImageWriter::Callback done = nullptr)
+        {
+            if (m_queue)
+            {
+                return m_queue->submit(makeJob(), m_queuePriority, std::move(done));
+            }
+
+            build();
+
+            auto image = std::make_unique<Image>(m_image->width(), m_image->height());
+            renderImage(m_worlds, *image);
+            return writer().write(m_output, std::move(image), std::move(done));
+        }
+
+        // Coordinator of a distributed render: listens on the Unix socket `path`, hands batches
+        // of tiles to the `rayt --worker` processes that connect, merges the float sums they
+        // send back and writes the image. Tiles a worker has not returned when its connection
+        // drops are handed out again; each tile seeds its own random sequence, so a reissued
+        // tile gives the same result as the lost one.
+        std::future<bool> renderCoordinator(const std::string &path, ImageWriter::Callback done = nullptr)
+        {
+            std::promise<bool> failed;
+            failed.set_value(false);
+#ifdef __linux__
+            int nx = m_image->width();
+            int ny = m_image->height();
+            std::vector<Tile> tiles = make_tiles(nx, ny, m_tileSize, m_tileOrder);
+            int tileCount = int(tiles.size());
+
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            unlink(path.c_str());
+            int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listenFd < 0 || bind(listenFd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listenFd, 64) != 0)
+            {
+                perror(path.c_str());
+                if (listenFd >= 0)
+                {
+                    close(listenFd);
+                }
+                return failed.get_future();
+            }
+
+            AccumBuffer accum(nx, ny, m_tileSize, true); // locked anyway, receiving dominates
+            Progress progress(tileCount, (long long)nx * ny * m_samples, m_progressInterval, m_progressJson);
+            std::mutex mtx;
+            std::condition_variable cv;
+            std::deque<int> pending(tileCount);
+            std::iota(pending.begin(), pending.end(), 0);
+            int finished = 0;
+            bool aborted = false;
+            std::vector<int> connections;
+            int workers = 0;
+            auto lastActive = clock::now();
+
+            auto serve = [&](int fd)
+            {
+                int hello[6];
+                bool ok = recv_all(fd, hello, sizeof(hello)) && hello[0] == DIST_MAGIC &&
+                          hello[2] == nx && hello[3] == ny && hello[4] == m_tileSize && hello[5] == m_samples;
+                if (!ok)
+                {
+                    std::cerr << "Coordinator: rejected a worker with a different setup" << std::endl;
+                }
+                std::vector<int> assigned;
+                std::vector<float> rgb(3 * m_tileSize * m_tileSize);
+                std::vector<int> counts(m_tileSize * m_tileSize);
+                while (ok)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(mtx);
+                        cv.wait(lock, [&]()
+                                { return !pending.empty() || finished == tileCount || aborted; });
+                        while (!aborted && !pending.empty() && int(assigned.size()) < std::max(1, hello[1]))
+                        {
+                            assigned.push_back(pending.front());
+                            pending.pop_front();
+                        }
+                    }
+                    int count = int(assigned.size());
+                    if (!send_all(fd, &count, sizeof(count)) || !send_all(fd, assigned.data(), count * sizeof(int)) || count == 0)
+                    {
+                        break;
+                    }
+                    while (ok && !assigned.empty())
+                    {
+                        int t;
+                        uint64_t rays;
+                        ok = recv_all(fd, &t, sizeof(t)) && recv_all(fd, &rays, sizeof(rays));
+                        auto it = std::find(assigned.begin(), assigned.end(), t);
+                        if (!ok || it == assigned.end())
+                        {
+                            ok = false;
+                            break;
+                        }
+                        const Tile &tile = tiles[t];
+                        int w = tile.x1 - tile.x0;
+                        int h = tile.y1 - tile.y0;
+                        ok = recv_all(fd, rgb.data(), 3 * w * h * sizeof(float)) && recv_all(fd, counts.data(), w * h * sizeof(int));
+                        if (!ok)
+                        {
+                            break;
+                        }
+                        for (int j = 0; j < h; ++j)
+                        {
+                            accum.addSpan(tile.x0, tile.y0 + j, w, &rgb[3 * w * j], &counts[w * j]);
+                        }
+                        progress.add(t, (long long)w * h * m_samples, rays);
+                        assigned.erase(it);
+                        {
+                            std::lock_guard<std::mutex> lock(mtx);
+                            ++finished;
+                            lastActive = clock::now();
+                        }
+                        cv.notify_all();
+                    }
+                }
+                std::lock_guard<std::mutex> lock(mtx);
+                if (!assigned.empty())
+                {
+                    std::cerr << "Coordinator: lost a worker, reissuing " << assigned.size() << " tiles" << std::endl;
+                    pending.insert(pending.begin(), assigned.begin(), assigned.end());
+                }
+                connections.erase(std::find(connections.begin(), connections.end(), fd));
+                close(fd);
+                lastActive = clock::now();
+                cv.notify_all();
+            };
+
+            std::vector<std::thread> handlers;
+            for (;;)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (finished == tileCount)
+                    {
+                        break;
+                    }
+                    if (connections.empty() && clock::now() - lastActive > std::chrono::duration<float>(DIST_IDLE_TIMEOUT))
+                    {
+                        std::cerr << "Coordinator: no workers, giving up with " << tileCount - finished << " tiles left" << std::endl;
+                        aborted = true;
+                        break;
+                    }
+                }
+                pollfd pfd = {listenFd, POLLIN, 0};
+                if (poll(&pfd, 1, 200) > 0)
+                {
+                    int fd = accept(listenFd, nullptr, nullptr);
+                    if (fd >= 0)
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        connections.push_back(fd);
+                        ++workers;
+                        handlers.emplace_back(serve, fd);
+                    }
+                }
+            }
+            close(listenFd);
+            unlink(path.c_str());
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (int fd : connections)
+                {
+                    shutdown(fd, SHUT_RDWR); // unblocks handlers still waiting for a worker when aborting
+                }
+            }
+            cv.notify_all();
+            for (auto &t : handlers)
+            {
+                t.join();
+            }
+            progress.finish();
+            if (aborted)
+            {
+                return failed.get_future();
+            }
+            std::cerr << "Coordinator: merged " << tileCount << " tiles from " << workers << " workers" << std::endl;
+            auto image = std::make_unique<Image>(nx, ny);
+            accum.resolve(*image);
+            return writer().write(m_output, std::move(image), std::move(done));
+#else
+            std::cerr << "distributed rendering needs Unix domain sockets" << std::endl;
+            return failed.get_future();
+#endif
+        }
+
+        // Worker of a distributed render: connects to the coordinator at `path` (retrying for a
+        // few seconds while it starts up) and renders the tiles it is given until told to stop.
+        bool renderWorker(const std::string &path)
+        {
+#ifdef __linux__
+            build();
+
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            int fd = -1;
+            for (int attempt = 0; attempt < 100 && fd < 0; ++attempt)
+            {
+                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+                {
+                    close(fd);
+                    fd = -1;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                }
+            }
+            if (fd < 0)
+            {
+                std::cerr << "Worker: cannot connect to " << path << std::endl;
+                return false;
+            }
+
+            int nx = m_image->width();
+            int ny = m_image->height();
+            std::vector<Tile> tiles = make_tiles(nx, ny, m_tileSize, m_tileOrder);
+            int hello[6] = {DIST_MAGIC, pool().size(), nx, ny, m_tileSize, m_samples};
+            bool ok = send_all(fd, hello, sizeof(hello));
+            std::vector<int> assigned;
+            std::vector<std::vector<float>> rgb;
+            std::vector<uint64_t> rays;
+            std::vector<int> counts(m_tileSize * m_tileSize, m_samples);
+            while (ok)
+            {
+                int count;
+                if (!recv_all(fd, &count, sizeof(count)) || count <= 0)
                 {
-                    hrec.t = temp;
-                    hrec.p = r.at(hrec.t);
-                    hrec.n = (hrec.p - m_center) / m_radius;
-                    hrec.mat = m_material;
-                    get_sphere_uv(hrec.n, hrec.u, hrec.v);
-                    return true;
+                    break;
                 }
-                temp = (-b + root) / (2.0f * a);
-                if (temp < t1 && temp > t0)
+                assigned.resize(count);
+                ok = recv_all(fd, assigned.data(), count * sizeof(int));
+                for (int t : assigned)
                 {
-                    hrec.t = temp;
-                    hrec.p = r.at(hrec.t);
-                    hrec.n = (hrec.p - m_center) / m_radius;
-                    hrec.mat = m_material;
-                    get_sphere_uv(hrec.n, hrec.u, hrec.v);
-                    return true;
+                    ok = ok && t >= 0 && t < int(tiles.size());
+                }
+                if (!ok)
+                {
+                    break;
+                }
+                rgb.resize(count);
+                rays.assign(count, 0);
+                pool().parallelFor(count, [&](int k, int worker)
+                                   {
+                    const Tile &tile = tiles[assigned[k]];
+                    rgb[k].resize(3 * (tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+                    uint64_t before = ray_count();
+                    renderTile(*m_worlds[pool().node(worker) % m_worlds.size()], tile, assigned[k], rgb[k].data());
+                    rays[k] = ray_count() - before; });
+                for (int k = 0; k < count && ok; ++k)
+                {
+                    ok = send_all(fd, &assigned[k], sizeof(int)) && send_all(fd, &rays[k], sizeof(uint64_t)) &&
+                         send_all(fd, rgb[k].data(), rgb[k].size() * sizeof(float)) &&
+                         send_all(fd, counts.data(), rgb[k].size() / 3 * sizeof(int));
                 }
             }
-
+            close(fd);
+            return ok;
+#else
+            std::cerr << "distributed rendering needs Unix domain sockets" << std::endl;
             return false;
+#endif
         }
 
-    private:
-        vec3 m_center;
-        float m_radius;
-        MaterialPtr m_material;
-    };
-
-    class Rect : public Shape
-    {
-    public:
-        enum AxisType
+        // Build the scene and return it as a job for a RenderQueue; the job writes the
+        // image render() would. The job renders its own copy of the world, so the scene can
+        // be built again meanwhile, but the scene has to outlive the job.
+        std::unique_ptr<RenderJob> makeJob()
         {
-            kXY = 0,
-            kXZ,
-            kYZ,
-        };
-        Rect() {}
-        Rect(float x0, float x1, float y0, float y1, float k, AxisType axis, const MaterialPtr &m)
-            : m_x0(x0), m_x1(x1), m_y0(y0), m_y1(y1), m_k(k), m_axis(axis), m_material(m) {}
+            return std::make_unique<Job>(*this, buildWorlds(0.f));
+        }
 
-        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        // Render frames 0 .. frames - 1 of the animation (time frame / frames) into
+        // frame_0000.bmp, ... . With depth > 0 the world of the next frames is built on its own
+        // thread and the previous images are written by an ImageWriter while a frame renders,
+        // with at most `depth` built worlds and `depth` finished images waiting in between.
+        // depth 0 runs build, render and write one after another.
+        void renderAnimation(int frames, int depth)
         {
-            int xi, yi, zi;
-            vec3 axis;
-            switch (m_axis)
+            typedef std::vector<std::unique_ptr<World>> Worlds;
+            struct Built
             {
-            case kXY:
+                int frame;
+                Worlds worlds;
+            };
+
+            auto buildFrame = [&](int frame)
             {
-                xi = 0;
-                yi = 1;
-                zi = 2;
-                axis = vec3::zAxis();
-                break;
+                return Built{frame, buildWorlds(float(frame) / frames)};
             };
-            case kXZ:
+            auto renderFrame = [&](const Built &b)
             {
-                xi = 0;
-                yi = 2;
-                zi = 1;
-                axis = vec3::yAxis();
-                break;
+                auto t0 = clock::now();
+                auto image = std::make_unique<Image>(m_image->width(), m_image->height());
+                renderImage(b.worlds, *image);
+                float elapsed = std::chrono::duration<float>(clock::now() - t0).count();
+                std::cerr << "Frame " << b.frame << ": " << elapsed << "s" << std::endl;
+                return image;
             };
-            case kYZ:
+            auto start = clock::now();
+            ImageWriter frameWriter(std::max(depth, 1));
+            auto writeFrame = [&](int frame, std::unique_ptr<Image> image)
             {
-                xi = 1;
-                yi = 2;
-                zi = 0;
-                axis = vec3::xAxis();
-                break;
+                char filename[32];
+                snprintf(filename, sizeof(filename), "frame_%04d.bmp", frame);
+                return frameWriter.write(filename, std::move(image));
             };
+
+            if (depth <= 0)
+            {
+                for (int f = 0; f < frames; ++f)
+                {
+                    writeFrame(f, renderFrame(buildFrame(f))).wait();
+                }
             }
-            float t = (m_k - r.origin()[zi]) / r.direction()[zi];
-            if (t < t0 || t > t1)
+            else
             {
-                return false;
+                BoundedQueue<Built> built(depth);
+                std::thread builder([&]()
+                                    {
+                    for (int f = 0; f < frames; ++f)
+                    {
+                        built.push(buildFrame(f));
+                    }
+                    built.close(); });
+                Built b;
+                std::future<bool> last;
+                while (built.pop(b))
+                {
+                    last = writeFrame(b.frame, renderFrame(b));
+                }
+                builder.join();
+                if (last.valid())
+                {
+                    last.wait(); // images are written in order
+                }
             }
+            float elapsed = std::chrono::duration<float>(clock::now() - start).count();
+            fprintf(stderr, "%d frames in %.2fs: %.1f frames/min\n", frames, elapsed, frames * 60.f / elapsed);
+        }
 
-            float x = r.origin()[xi] + t * r.direction()[xi];
-            float y = r.origin()[yi] + t * r.direction()[yi];
-            if (x < m_x0 || x > m_x1 || y < m_y0 || y > m_y1)
+        // Render in passes of `passSamples` spp until `seconds` have elapsed.
+        // Tiles of several passes are scheduled together, so threads rarely wait at a
+        // pass boundary, and the deadline is checked per pixel. Every `previewInterval`
+        // seconds (0: never) the current mean is written out.
+        // With path guiding, up to a quarter of the budget trains the guiding tree first.
+        // The result reports (and `done` is called for) the last file, the .hdr.
+        std::future<bool> renderProgressive(float seconds, int passSamples, float previewInterval,
+                                            ImageWriter::Callback done = nullptr)
+        {
+            build();
+
+            int nx = m_image->width();
+            int ny = m_image->height();
+            AccumBuffer accum(nx, ny, m_tileSize, true);
+
+            auto start = clock::now();
+            auto deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(seconds));
+            const char *filename = "render_progressive.bmp";
+
+            if (m_pathGuiding)
             {
-                return false;
+                trainGuide(start + (deadline - start) / 4);
             }
 
-            hrec.u = (x - m_x0) / (m_x1 - m_x0);
-            hrec.v = (y - m_y0) / (m_y1 - m_y0);
-            hrec.t = t;
-            hrec.mat = m_material;
-            hrec.p = r.at(t);
-            hrec.n = axis;
-            return true;
+            std::mutex mtx;
+            std::condition_variable cv;
+            bool finished = false;
+            std::thread preview;
+            if (previewInterval > 0.f)
+            {
+                preview = std::thread([&]()
+                                      {
+                    auto interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<float>(previewInterval));
+                    std::unique_lock<std::mutex> lock(mtx);
+                    while (!cv.wait_for(lock, interval, [&]() { return finished; }))
+                    {
+                        auto img = std::make_unique<Image>(nx, ny);
+                        accum.resolve(*img);
+                        writer().write(filename, std::move(img));
+                        float elapsed = std::chrono::duration<float>(clock::now() - start).count();
+                        std::cerr << "Preview " << elapsed << "s: " << float(accum.totalSamples()) / (nx * ny) << " spp" << std::endl;
+                    } });
+            }
+
+            accumulate(accum, deadline, passSamples, INT_MAX);
+
+            if (preview.joinable())
+            {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    finished = true;
+                }
+                cv.notify_one();
+                preview.join();
+            }
+
+            auto img = std::make_unique<Image>(nx, ny);
+            accum.resolve(*img);
+            writer().write(filename, std::move(img));
+            std::vector<float> hdr;
+            accum.resolve(hdr);
+            float elapsed = std::chrono::duration<float>(clock::now() - start).count();
+            std::cerr << "Done " << elapsed << "s: " << float(accum.totalSamples()) / (nx * ny) << " spp" << std::endl;
+            return writer().write("render_progressive.hdr", nx, ny, std::move(hdr), std::move(done));
         }
 
     private:
-        float m_x0;
-        float m_x1;
-        float m_y0;
-        float m_y1;
-        float m_k;
-        AxisType m_axis;
-        MaterialPtr m_material;
-    };
+        class Job : public RenderJob
+        {
+        public:
+            Job(Scene &scene, std::vector<std::unique_ptr<World>> worlds)
+                : m_scene(scene), m_worlds(std::move(worlds)),
+                  m_tiles(make_tiles(scene.m_image->width(), scene.m_image->height(), scene.m_tileSize, scene.m_tileOrder)),
+                  m_accum(scene.m_image->width(), scene.m_image->height(), scene.m_tileSize)
+            {
+            }
 
-    class ShapeList : public Shape
-    {
-    public:
-        ShapeList() {}
+            int tiles() const override { return int(m_tiles.size()); }
 
-        void add(const ShapePtr &shape)
+            void renderTile(int t, int node) override
+            {
+                const Tile &tile = m_tiles[t];
+                int w = tile.x1 - tile.x0;
+                int h = tile.y1 - tile.y0;
+                Arena::Scope scope(thread_arena());
+                float *rgb = scope.alloc<float>(3 * w * h);
+                int *counts = scope.alloc<int>(w);
+                std::fill(counts, counts + w, m_scene.m_samples);
+                m_scene.renderTile(*m_worlds[node % m_worlds.size()], tile, t, rgb);
+                for (int j = 0; j < h; ++j)
+                {
+                    m_accum.addSpan(tile.x0, tile.y0 + j, w, rgb + 3 * w * j, counts);
+                }
+            }
+
+            void finish(ImageWriter &writer, ImageWriter::Callback done) override
+            {
+                auto image = std::make_unique<Image>(m_accum.width(), m_accum.height());
+                m_accum.resolve(*image);
+                writer.write(m_scene.m_output, std::move(image), std::move(done));
+            }
+
+        private:
+            Scene &m_scene;
+            std::vector<std::unique_ptr<World>> m_worlds;
+            std::vector<Tile> m_tiles;
+            AccumBuffer m_accum;
+        };
+
+        ThreadPool &pool()
         {
-            m_list.push_back(shape);
+            if (!m_pool)
+            {
+                m_pool = std::make_unique<ThreadPool>(m_threads, m_numa ? &m_topology : nullptr);
+            }
+            return *m_pool;
         }
 
-        virtual bool hit(const Ray &r, float t0, float t1, HitRec &hrec) const override
+        ImageWriter &writer()
         {
-            HitRec temp_rec;
-            bool hit_anything = false;
-            float closest_so_far = t1;
-            for (auto &p : m_list)
+            std::lock_guard<std::mutex> lock(m_writerMutex);
+            if (!m_writer)
             {
-                if (p->hit(r, t0, closest_so_far, temp_rec))
-                {
-                    hit_anything = true;
-                    closest_so_far = temp_rec.t;
-                    hrec = temp_rec;
-                }
+                m_writer = std::make_unique<ImageWriter>();
             }
-            return hit_anything;
+            return *m_writer;
         }
 
-    private:
-        std::vector<ShapePtr> m_list;
-    };
+        // Sums of m_samples samples for the pixels of tile (number `index`), row by row.
+        // The tile seeds its own random sequence, so it renders the same on any thread or process.
+        void renderTile(const World &world, const Tile &tile, int index, float *rgb) const
+        {
+            renderSlot(world, tile, hash_seed(index, 0), m_samples, rgb);
+        }
 
-    class Scene
-    {
-    public:
-        Scene(int width, int height, int samples)
-            : m_image(new Image(width, height)), m_backColor(0.1f), m_samples(samples)
+        // Wavefront integrator: sums of `samples` samples per pixel of tile, row by row, like
+        // renderSlot. Up to WAVEFRONT_PATHS paths are traced together, one bounce at a time, by
+        // separate loops: intersect all, sort the hits by material type, shade each material's
+        // hits together, emitting shadow and extension rays into queues, then trace the shadow rays.
+        void renderWavefront(const World &world, const Tile &tile, int samples, float *rgb) const
         {
+            withFeatures(features(world), [&](auto f)
+                         { renderWavefront<decltype(f)::value>(world, tile, samples, rgb); });
         }
 
-        void build()
+        // renderWavefront for a world with the SceneFeature mask F; the specialized integrators
+        // shade every hit from the material table
+        template <unsigned F>
+        void renderWavefront(const World &world, const Tile &tile, int samples, float *rgb) const
         {
-            // Camera
+            bool table = F & kGeneralFeature ? m_materialTable : true;
+            int nx = m_image->width();
+            int ny = m_image->height();
+            int w = tile.x1 - tile.x0;
+            int pixels = w * (tile.y1 - tile.y0);
+            int total = pixels * samples;
+            std::fill(rgb, rgb + 3 * pixels, 0.f);
 
-            vec3 lookfrom(13, 2, 3);
-            vec3 lookat(0, 1, 0);
-            vec3 vup(0, 1, 0);
-            float aspect = float(m_image->width()) / float(m_image->height());
-            m_camera = std::make_unique<Camera>(lookfrom, lookat, vup, 30, aspect);
+            Arena::Scope scope(thread_arena());
+            int capacity = std::min(WAVEFRONT_PATHS, total);
+            PathQueue paths(scope, capacity);
+            PathQueue next(scope, capacity);
+            PathQueue shadows(scope, 2 * capacity);
+            HitRec *hits = scope.alloc<HitRec>(capacity);
+            int *order = scope.alloc<int>(capacity);
+            vec3 *albedos = table ? scope.alloc<vec3>(capacity) : nullptr;
+            int *index = table ? scope.alloc<int>(capacity) : nullptr;
+            uint64_t *keys = m_raySorting ? scope.alloc<uint64_t>(capacity) : nullptr;
+            BVHView primary = primaryView(world, tile, scope);
+            for (int base = 0; base < total; base += capacity)
+            {
+                // camera rays, consecutive paths go to neighbouring pixels
+                paths.size = 0;
+                for (int k = base; k < std::min(base + capacity, total); ++k)
+                {
+                    int pix = k % pixels;
+                    float u = float(tile.x0 + pix % w + random_float()) / float(nx);
+                    float v = float(tile.y0 + pix / w + random_float()) / float(ny);
+                    paths.push(world.camera.getRay(u, v), FLT_MAX, vec3(1), pix, true);
+                }
 
-            // Shapes
+                for (int depth = 0; paths.size > 0; ++depth)
+                {
+                    if (m_raySorting && depth > 0)
+                    {
+                        sortRays(world, paths, next, keys);
+                        std::swap(paths, next);
+                    }
 
-            ShapeList *world = new ShapeList();
-            world->add(std::make_shared<Sphere>(
-                vec3(0, 2, 0), 2,
-                std::make_shared<Lambertian>(
-                    std::make_shared<ColorTexture>(vec3(0.5f, 0.5f, 0.5f)))));
-            world->add(std::make_shared<Sphere>(
-                vec3(0, -1000, 0), 1000,
-                std::make_shared<Lambertian>(
-                    std::make_shared<ColorTexture>(vec3(0.8f, 0.8f, 0.8f)))));
-            world->add(std::make_shared<Rect>(
-                3, 5, 1, 3, -2, Rect::kXY,
-                std::make_shared<DiffuseLight>(
-                    std::make_shared<ColorTexture>(vec3(4)))));
+                    // intersect; misses are done here, hits are counted by material type
+                    int first[kMaterialTypes + 1] = {};
+                    for (int k = 0; k < paths.size; ++k)
+                    {
+                        Ray r = paths.ray(k);
+                        if (trace(world, depth == 0 ? primary : BVHView(), r, 0.001f, FLT_MAX, hits[k]))
+                        {
+                            ++first[materialType<F>(world, hits[k]) + 1];
+                        }
+                        else
+                        {
+                            hits[k].mat = nullptr;
+                            add_rgb(rgb, paths.pixel[k], mulPerElem(paths.weight(k), miss<F>(r, world, paths.countEmitted[k])));
+                        }
+                    }
+
+                    // sort the hits by material type
+                    for (int m = 0; m < kMaterialTypes; ++m)
+                    {
+                        first[m + 1] += first[m];
+                    }
+                    int fill[kMaterialTypes];
+                    std::copy(first, first + kMaterialTypes, fill);
+                    for (int k = 0; k < paths.size; ++k)
+                    {
+                        if (hits[k].mat)
+                        {
+                            order[fill[materialType<F>(world, hits[k])]++] = k;
+                        }
+                    }
+
+                    // shade one material type after another
+                    next.size = 0;
+                    shadows.size = 0;
+                    Batch batch = {paths, hits, order, albedos, index, depth, next, shadows, rgb};
+                    shadeBatch<kLambertianMaterial, F>(world, batch, first[0], first[1]);
+                    shadeBatch<kMetalMaterial, F>(world, batch, first[1], first[2]);
+                    shadeBatch<kDielectricMaterial, F>(world, batch, first[2], first[3]);
+                    shadeBatch<kDiffuseLightMaterial, F>(world, batch, first[3], first[4]);
+                    shadeBatch<kOtherMaterial, F>(world, batch, first[4], first[5]);
+
+                    // shadow rays
+                    for (int k = 0; k < shadows.size; ++k)
+                    {
+                        HitRec tmp;
+                        if (!trace(world, shadows.ray(k), 0.001f, shadows.tmax[k], tmp))
+                        {
+                            add_rgb(rgb, shadows.pixel[k], shadows.weight(k));
+                        }
+                    }
+                    std::swap(paths, next);
+                }
+            }
+        }
+
+        // what one bounce of the wavefront integrator works on
+        struct Batch
+        {
+            const PathQueue &paths;
+            const HitRec *hits;
+            const int *order; // path indices sorted by material type
+            vec3 *albedos;    // with the material table: texture values per path
+            int *index;       // with the material table: scratch for grouping hits by texture
+            int depth;
+            PathQueue &next;    // extension rays
+            PathQueue &shadows; // shadow rays
+            float *rgb;         // sums per pixel of the tile
+        };
 
-            m_world.reset(world);
+        static void add_rgb(float *rgb, int pix, const vec3 &c)
+        {
+            rgb[3 * pix + 0] += c.getX();
+            rgb[3 * pix + 1] += c.getY();
+            rgb[3 * pix + 2] += c.getZ();
         }
 
-        vec3 color(const rayt::Ray &r, const Shape *world, int depth) const
+        template <unsigned F = kAllFeatures>
+        MaterialType materialType(const World &world, const HitRec &hrec) const
         {
-            HitRec hrec;
-            if (world->hit(r, 0.001f, FLT_MAX, hrec))
+            bool table = F & kGeneralFeature ? m_materialTable && hrec.matId != kNoMaterialId : true;
+            return table ? world.materials.type(hrec.matId) : hrec.mat->type();
+        }
+
+        // Shade the hits order[begin, end) of batch, all on materials of type T: add what they
+        // emit, and queue the scattered rays and the shadow rays of direct light. With the
+        // material table on, the built-in materials are shaded without virtual calls, and the
+        // albedos of all hits are looked up together first. F is the world's feature mask, as
+        // for the recursive integrator; without kTextureFeature the albedos are plain colors.
+        template <MaterialType T, unsigned F = kAllFeatures>
+        void shadeBatch(const World &world, Batch &batch, int begin, int end) const
+        {
+            bool lights = lightSampling<F>(world);
+            bool nee = lights || environment<F>();
+            bool table = (F & kGeneralFeature ? m_materialTable : true) && T != kOtherMaterial;
+            bool albedos = table && (F & kTextureFeature) && (T == kLambertianMaterial || T == kMetalMaterial);
+            if (albedos)
+            {
+                world.materials.textures(batch.hits, batch.order + begin, end - begin, batch.index, batch.albedos);
+            }
+            for (int n = begin; n < end; ++n)
             {
-                vec3 emitted = hrec.mat->emitted(r, hrec);
+                int k = batch.order[n];
+                const HitRec &hrec = batch.hits[k];
+                Ray r = batch.paths.ray(k);
+                vec3 beta = batch.paths.weight(k);
+                int pix = batch.paths.pixel[k];
+                if ((F & kEmissionFeature) && (batch.paths.countEmitted[k] || !lights))
+                {
+                    vec3 Le = table ? world.materials.emitted<T, F>(r, hrec) : hrec.mat->emitted(r, hrec);
+                    add_rgb(batch.rgb, pix, mulPerElem(beta, Le));
+                }
                 ScatterRec srec;
-                if (depth < MAX_DEPTH && hrec.mat->scatter(r, hrec, srec))
+                if (batch.depth >= MAX_DEPTH ||
+                    !(albedos ? world.materials.scatter<T>(r, hrec, batch.albedos[k], srec)
+                      : table ? world.materials.scatter<T, F>(r, hrec, srec)
+                              : hrec.mat->scatter(r, hrec, srec)))
                 {
-
-                    return emitted + mulPerElem(srec.albedo, color(srec.ray, world, depth + 1));
+                    continue;
                 }
-                else
+                beta = mulPerElem(beta, srec.albedo);
+                bool direct = srec.diffuse && nee;
+                if (direct)
                 {
-                    return emitted;
+                    Ray shadow;
+                    float t1;
+                    vec3 L;
+                    if (lights && lightRay(hrec, world, shadow, t1, L))
+                    {
+                        batch.shadows.push(shadow, t1, mulPerElem(beta, L), pix, false);
+                    }
+                    if (environment<F>() && environmentRay(hrec, shadow, L))
+                    {
+                        batch.shadows.push(shadow, FLT_MAX, mulPerElem(beta, L), pix, false);
+                    }
                 }
+                batch.next.push(srec.ray, FLT_MAX, beta, pix, !direct);
+            }
+        }
+
+        // Reorder the rays of paths into out, by direction octant and then by the Morton code of
+        // their origin within the world's bounds, so rays traced one after another start close
+        // together and go the same way.
+        void sortRays(const World &world, const PathQueue &paths, PathQueue &out, uint64_t *keys) const
+        {
+            auto start = clock::now();
+            // key: octant in bits 61-63, 9 bits per axis of the origin as a 27-bit Morton code
+            // in bits 32-58, the ray's index below
+            vec3 scale = divPerElem(vec3(511.f), maxPerElem(world.hi - world.lo, vec3(1e-6f)));
+            auto quantize = [](float x)
+            {
+                return uint32_t(std::min(std::max(x, 0.f), 511.f));
+            };
+            for (int k = 0; k < paths.size; ++k)
+            {
+                uint32_t octant = (paths.dx[k] < 0.f) | (paths.dy[k] < 0.f) << 1 | (paths.dz[k] < 0.f) << 2;
+                uint32_t cell = morton3(quantize((paths.ox[k] - world.lo.getX()) * scale.getX()),
+                                        quantize((paths.oy[k] - world.lo.getY()) * scale.getY()),
+                                        quantize((paths.oz[k] - world.lo.getZ()) * scale.getZ()));
+                keys[k] = uint64_t(octant) << 61 | uint64_t(cell) << 32 | uint32_t(k);
             }
-            return background(r.direction());
+            std::sort(keys, keys + paths.size);
+            out.size = 0;
+            for (int k = 0; k < paths.size; ++k)
+            {
+                out.copy(paths, int(keys[k] & 0xffffffffu));
+            }
+            ray_sort_time() += std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count();
         }
 
-        vec3 background(const vec3 &d) const
+        // sums of `samples` samples per pixel of tile from the random sequence `seed`, row by row
+        void renderSlot(const World &world, const Tile &tile, uint64_t seed, int samples, float *rgb) const
         {
-            return m_backColor;
+            seed_random(seed);
+            if (m_wavefront)
+            {
+                renderWavefront(world, tile, samples, rgb);
+                return;
+            }
+            Arena::Scope scope(thread_arena());
+            BVHView primary = primaryView(world, tile, scope);
+            int w = tile.x1 - tile.x0;
+            for (int j = tile.y0, rows; j < tile.y1; j += rows)
+            {
+                rows = m_packets && j + 1 < tile.y1 ? 2 : 1;
+                sampleRows(world, primary, tile, j, rows, samples, rgb + 3 * w * (j - tile.y0));
+            }
         }
 
-        vec3 backgroundSky(const vec3 &d) const
+        // render every pixel with m_samples spp into img
+        void renderImage(const std::vector<std::unique_ptr<World>> &worlds, Image &img)
         {
-            vec3 v = normalize(d);
-            float t = 0.5f * (v.getY() + 1.0f);
-            return lerp(t, vec3(1), vec3(0.5f, 0.7f, 1.0f));
+            int nx = img.width();
+            int ny = img.height();
+            std::vector<Tile> tiles = make_tiles(nx, ny, m_tileSize, m_tileOrder);
+            AccumBuffer accum(nx, ny, m_tileSize);
+            std::vector<int> counts(m_tileSize, m_samples);
+            Progress progress(int(tiles.size()), (long long)nx * ny * m_samples, m_progressInterval, m_progressJson);
+            std::atomic<uint64_t> totalRays(0);
+            std::atomic<uint64_t> sortTime(0);
+            PerfCounters perf;
+            if (m_perf)
+            {
+                pool();
+                perf.start();
+            }
+            auto start = clock::now();
+            if (m_sampleParallel)
+            {
+                renderSlots(worlds, tiles, accum, progress, totalRays);
+            }
+            else
+            {
+                pool().parallelFor(int(tiles.size()), [&](int t, int worker)
+                                   {
+                    const Tile &tile = tiles[t];
+                    const World &world = *worlds[pool().node(worker) % worlds.size()];
+                    Arena::Scope scope(thread_arena());
+                    int w = tile.x1 - tile.x0;
+                    uint64_t rays = ray_count();
+                    uint64_t sorting = ray_sort_time();
+                    float *rgb = scope.alloc<float>(3 * w * (tile.y1 - tile.y0));
+                    renderTile(world, tile, t, rgb);
+                    for (int j = tile.y0; j < tile.y1; ++j)
+                    {
+                        accum.addSpan(tile.x0, j, w, rgb + 3 * w * (j - tile.y0), counts.data());
+                    }
+                    long long samples = (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * m_samples;
+                    progress.add(t, samples, ray_count() - rays);
+                    totalRays += ray_count() - rays;
+                    sortTime += ray_sort_time() - sorting; });
+            }
+            progress.finish();
+            if (m_perf)
+            {
+                float elapsed = std::chrono::duration<float>(clock::now() - start).count();
+                fprintf(stderr, "render: %.3fs %.3f Mrays/s\n", elapsed, totalRays / elapsed * 1e-6f);
+                if (m_raySorting)
+                {
+                    fprintf(stderr, "ray sorting: %.3fs\n", sortTime * 1e-9f);
+                }
+                if (m_specialize)
+                {
+                    fprintf(stderr, "integrator: features 0x%x\n", features(*worlds[0]));
+                }
+                perf.print("counters");
+            }
+
+            accum.resolve(img);
+        }
+
+        // Sample-parallel render: the samples of every tile are split into a fixed number of
+        // slots, chosen from the tile count so there are about SAMPLE_SPLIT_TASKS tasks, each
+        // with its own random sequence and its own buffer. The slots of a tile are then added
+        // up in slot order, so the image is the same for any number of threads.
+        void renderSlots(const std::vector<std::unique_ptr<World>> &worlds, const std::vector<Tile> &tiles,
+                         AccumBuffer &accum, Progress &progress, std::atomic<uint64_t> &totalRays)
+        {
+            int tileCount = int(tiles.size());
+            int slots = std::max(1, std::min(m_samples, (SAMPLE_SPLIT_TASKS + tileCount - 1) / tileCount));
+            size_t block = 3 * size_t(m_tileSize) * m_tileSize;
+            std::vector<float> sums(block * tileCount * slots);
+            pool().parallelFor(tileCount * slots, [&](int k, int worker)
+                               {
+                int t = k / slots;
+                int slot = k % slots;
+                const Tile &tile = tiles[t];
+                int samples = m_samples / slots + (slot < m_samples % slots ? 1 : 0);
+                uint64_t rays = ray_count();
+                renderSlot(*worlds[pool().node(worker) % worlds.size()], tile, hash_seed(t, slot), samples,
+                           &sums[block * k]);
+                progress.add(t, (long long)(tile.x1 - tile.x0) * (tile.y1 - tile.y0) * samples, ray_count() - rays);
+                totalRays += ray_count() - rays; });
+            std::vector<int> counts(m_tileSize, m_samples);
+            pool().parallelFor(tileCount, [&](int t, int)
+                               {
+                const Tile &tile = tiles[t];
+                int w = tile.x1 - tile.x0;
+                int n = w * (tile.y1 - tile.y0);
+                Arena::Scope scope(thread_arena());
+                float *rgb = scope.alloc<float>(3 * n);
+                std::copy(&sums[block * t * slots], &sums[block * t * slots] + 3 * n, rgb);
+                for (int slot = 1; slot < slots; ++slot)
+                {
+                    const float *src = &sums[block * (t * slots + slot)];
+                    for (int k = 0; k < 3 * n; ++k)
+                    {
+                        rgb[k] += src[k];
+                    }
+                }
+                for (int j = 0; j < tile.y1 - tile.y0; ++j)
+                {
+                    accum.addSpan(tile.x0, tile.y0 + j, w, rgb + 3 * w * j, counts.data());
+                } });
         }
 
-        void render()
+        // Add up to `passes` passes of `passSamples` spp into accum, stopping at the deadline.
+        // A few passes share one parallel loop, so workers only meet at the end of a batch.
+        void accumulate(AccumBuffer &accum, clock::time_point deadline, int passSamples, int passes)
         {
+            const int batchPasses = 4;
+            std::vector<Tile> tiles = make_tiles(m_image->width(), m_image->height(), m_tileSize, m_tileOrder);
+            int count = int(tiles.size());
+            Progress progress(count, 0, m_progressInterval, m_progressJson);
+            std::vector<int> counts(m_tileSize, passSamples);
+            for (int pass = 0; pass < passes && clock::now() < deadline; pass += batchPasses)
+            {
+                int batch = std::min(batchPasses, passes - pass);
+                pool().parallelFor(batch * count, [&](int k, int worker)
+                                   {
+                    const Tile &tile = tiles[k % count];
+                    const World &world = *m_worlds[pool().node(worker) % m_worlds.size()];
+                    Arena::Scope scope(thread_arena());
+                    float *rgb = scope.alloc<float>(3 * m_tileSize);
+                    uint64_t rays = ray_count();
+                    long long samples = 0;
+                    withFeatures(features(world), [&](auto f)
+                                 {
+                        for (int j = tile.y0; j < tile.y1; ++j)
+                        {
+                            int n = 0;
+                            for (int i = tile.x0; i < tile.x1 && clock::now() < deadline; ++i, ++n)
+                            {
+                                vec3 c = sample<decltype(f)::value>(world, i, j, passSamples);
+                                rgb[3 * n + 0] = c.getX();
+                                rgb[3 * n + 1] = c.getY();
+                                rgb[3 * n + 2] = c.getZ();
+                            }
+                            accum.addSpan(tile.x0, j, n, rgb, counts.data());
+                            samples += (long long)n * passSamples;
+                        } });
+                    progress.add(k % count, samples, ray_count() - rays);
+                });
+            }
+        }
 
-            build();
+        // Training iterations of 1, 2, 4, ... spp; each one samples with the previous
+        // iteration's distributions and records into refined trees. The images are discarded.
+        void trainGuide(clock::time_point until)
+        {
+            vec3 lo, hi;
+            m_worlds[0]->shapes.bounds(lo, hi);
+            m_guide = std::make_unique<GuidingTree>(lo, hi);
+            m_guideTraining = true;
+            m_guideSampling = false;
 
             int nx = m_image->width();
             int ny = m_image->height();
-#pragma omp parallel for schedule(dynamic, 1) num_threads(NUM_THREAD)
-            for (int j = 0; j < ny; ++j)
+            int spp = 1;
+            for (;;)
             {
-                std::cerr << "Rendering (y = " << j << ") " << (100.0 * j / (ny - 1)) << "%" << std::endl;
-                for (int i = 0; i < nx; ++i)
+                auto t0 = clock::now();
+                AccumBuffer scratch(nx, ny, m_tileSize, true);
+                accumulate(scratch, until, spp, 1);
+                m_guide->refine(spp);
+                m_guideSampling = true;
+                auto t1 = clock::now();
+                std::cerr << "Guiding iteration " << spp << " spp: " << m_guide->leaves() << " leaves" << std::endl;
+                if (t1 + 2 * (t1 - t0) > until)
                 {
-                    vec3 c(0);
-                    for (int s = 0; s < m_samples; ++s)
-                    {
-                        float u = float(i + drand48()) / float(nx);
-                        float v = float(j + drand48()) / float(ny);
-                        Ray r = m_camera->getRay(u, v);
-                        c += color(r, m_world.get(), 0);
-                    }
-
-                    c /= m_samples;
-                    m_image->write(i, (ny - j - 1), c.getX(), c.getY(), c.getZ());
+                    break;
                 }
+                spp *= 2;
             }
-
-            stbi_write_bmp("render_rect_tonemap.bmp", nx, ny, sizeof(Image::rgb), m_image->pixels());
+            m_guideTraining = false;
         }
 
     private:
-        std::unique_ptr<Camera> m_camera;
         std::unique_ptr<Image> m_image;
-        std::unique_ptr<Shape> m_world;
-        vec3 m_backColor;
+        std::vector<std::unique_ptr<World>> m_worlds; // per NUMA node
         int m_samples;
+        SceneType m_sceneType;
+        LightSampling m_lightSampling;
+        std::unique_ptr<EnvironmentLight> m_environment;
+        bool m_pathGuiding;
+        bool m_guideTraining;
+        bool m_guideSampling;
+        std::unique_ptr<GuidingTree> m_guide;
+        int m_threads;
+        int m_tileSize;
+        TileOrder m_tileOrder;
+        bool m_sampleParallel;
+        bool m_packets;
+        bool m_wavefront;
+        bool m_raySorting;
+        bool m_bvh;
+        bool m_frustumCulling;
+        bool m_materialTable;
+        bool m_specialize;
+        int m_features; // forced SceneFeature bits, -1: none
+        RenderQueue *m_queue;
+        int m_queuePriority;
+        std::unique_ptr<ThreadPool> m_pool;
+        float m_progressInterval;
+        bool m_progressJson;
+        bool m_perf;
+        bool m_numa;
+        NumaTopology m_topology;
+        std::string m_output;
+        std::mutex m_writerMutex;
+        std::unique_ptr<ImageWriter> m_writer; // destroyed first, so pending images are written before the scene goes
     };
-}
\ No newline at end of file
+}
@@ -0,0 +1,193 @@
+// Lane-by-lane checks of the x86 SoA vector types (vectormath/x86) against
+// Vectormath::Aos on the same backend as rayt: build with -DRAYT_VECTORMATH_SSE
+// for SSE, without for scalar; -mavx2 adds the 8-wide types. See `make test`.
+
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+
+#ifdef RAYT_VECTORMATH_SSE
+#include "../vectormath/SSE/cpp/vectormath_aos.h"
+#else
+#include "../vectormath/scalar/cpp/vectormath_aos.h"
+#endif
+#include "../vectormath/x86/vectormath_soa4.h"
+#ifdef __AVX2__
+#include "../vectormath/x86/vectormath_soa8.h"
+#endif
+
+namespace Aos = Vectormath::Aos;
+namespace Soa = Vectormath::Soa;
+
+static int s_checks = 0;
+static int s_failures = 0;
+
+static void check(bool ok, const char *what, int lane, float got, float want)
+{
+    ++s_checks;
+    if (!ok)
+    {
+        if (++s_failures <= 20)
+        {
+            printf("FAIL %s lane %d: %g, expected %g\n", what, lane, got, want);
+        }
+    }
+}
+
+// exact for arithmetic done the same way in both, a few ulps for sqrt/division
+static void checkNear(const char *what, int lane, float got, float want)
+{
+    check(std::fabs(got - want) <= 1e-5f * std::fmax(1.f, std::fabs(want)), what, lane, got, want);
+}
+
+static void checkExact(const char *what, int lane, float got, float want)
+{
+    check(got == want, what, lane, got, want);
+}
+
+static void checkNear(const char *what, int lane, float x, float y, float z, const Aos::Vector3 &want)
+{
+    checkNear(what, lane, x, float(want.getX()));
+    checkNear(what, lane, y, float(want.getY()));
+    checkNear(what, lane, z, float(want.getZ()));
+}
+
+static void checkExact(const char *what, int lane, float x, float y, float z, const Aos::Vector3 &want)
+{
+    checkExact(what, lane, x, float(want.getX()));
+    checkExact(what, lane, y, float(want.getY()));
+    checkExact(what, lane, z, float(want.getZ()));
+}
+
+// deterministic floats in [-10, 10)
+static float random_float()
+{
+    static uint32_t state = 12345;
+    state = state * 1664525u + 1013904223u;
+    return float(state >> 8) / float(1 << 24) * 20.f - 10.f;
+}
+
+// one width of SoA types: N lanes of F (floats), B (masks) and V (3-D vectors)
+template <int N, typename F, typename B, typename V>
+struct SoaTest
+{
+    float x[3][N], y[3][N], t[N], m[N];
+
+    static V load(const float (&v)[3][N])
+    {
+        return V(F::load(v[0]), F::load(v[1]), F::load(v[2]));
+    }
+
+    static Aos::Vector3 lane(const float (&v)[3][N], int k)
+    {
+        return Aos::Vector3(v[0][k], v[1][k], v[2][k]);
+    }
+
+    void randomize()
+    {
+        for (int k = 0; k < N; ++k)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                x[i][k] = random_float();
+                y[i][k] = random_float();
+            }
+            t[k] = random_float() * 0.1f;
+            m[k] = random_float();
+        }
+        // equal lanes, so the compares and min/max see ties
+        x[0][N - 1] = y[0][N - 1];
+        m[0] = 0.f;
+    }
+
+    void run(int rounds)
+    {
+        for (int round = 0; round < rounds; ++round)
+        {
+            randomize();
+            V a = load(x), b = load(y);
+            F tt = F::load(t), mm = F::load(m);
+            F d = Soa::dot(a, b);
+            V c = Soa::cross(a, b);
+            V n = Soa::normalize(a);
+            V mul = Soa::mulPerElem(a, b);
+            V lo = Soa::minPerElem(a, b);
+            V hi = Soa::maxPerElem(a, b);
+            V l = Soa::lerp(tt, a, b);
+            B mask = mm > F(0.f);
+            V s = Soa::select(a, b, mask);
+            F sx = Soa::select(a.getX(), b.getX(), mask);
+            for (int k = 0; k < N; ++k)
+            {
+                Aos::Vector3 ak = lane(x, k), bk = lane(y, k);
+                checkNear("dot", k, d.get(k), float(Aos::dot(ak, bk)));
+                checkNear("cross", k, c.getX().get(k), c.getY().get(k), c.getZ().get(k), Aos::cross(ak, bk));
+                checkNear("normalize", k, n.getX().get(k), n.getY().get(k), n.getZ().get(k), Aos::normalize(ak));
+                checkExact("mulPerElem", k, mul.getX().get(k), mul.getY().get(k), mul.getZ().get(k),
+                           Aos::mulPerElem(ak, bk));
+                checkExact("minPerElem", k, lo.getX().get(k), lo.getY().get(k), lo.getZ().get(k),
+                           Aos::minPerElem(ak, bk));
+                checkExact("maxPerElem", k, hi.getX().get(k), hi.getY().get(k), hi.getZ().get(k),
+                           Aos::maxPerElem(ak, bk));
+                checkNear("lerp", k, l.getX().get(k), l.getY().get(k), l.getZ().get(k), Aos::lerp(t[k], ak, bk));
+                // select1 ? b : a, like Aos::select
+                checkExact("select", k, s.getX().get(k), s.getY().get(k), s.getZ().get(k),
+                           Aos::select(ak, bk, m[k] > 0.f));
+                checkExact("select float", k, sx.get(k), m[k] > 0.f ? y[0][k] : x[0][k]);
+            }
+            compares(a.getX(), b.getX());
+        }
+    }
+
+    // each compare sets exactly the lanes where it holds, and the mask operators combine lanes
+    void compares(const F &a, const F &b)
+    {
+        B lt = a < b, le = a <= b, gt = a > b, ge = a >= b;
+        for (int k = 0; k < N; ++k)
+        {
+            float ak = x[0][k], bk = y[0][k];
+            checkExact("<", k, lt.get(k), ak < bk);
+            checkExact("<=", k, le.get(k), ak <= bk);
+            checkExact(">", k, gt.get(k), ak > bk);
+            checkExact(">=", k, ge.get(k), ak >= bk);
+            checkExact("&", k, (lt & le).get(k), ak < bk);
+            checkExact("|", k, (lt | gt).get(k), ak != bk);
+            checkExact("!", k, (!lt).get(k), !(ak < bk));
+        }
+        int bits = 0;
+        for (int k = 0; k < N; ++k)
+        {
+            bits |= (x[0][k] < y[0][k]) << k;
+        }
+        checkExact("bits", 0, float(lt.bits()), float(bits));
+        checkExact("any", 0, Soa::any(lt), bits != 0);
+        checkExact("all", 0, Soa::all(lt | ge), 1.f);
+        checkExact("all", 1, Soa::all(lt), bits == (1 << N) - 1);
+    }
+};
+
+int main()
+{
+#ifdef RAYT_VECTORMATH_SSE
+    const char *backend = "sse";
+#else
+    const char *backend = "scalar";
+#endif
+    SoaTest<4, Soa::floatx4, Soa::boolx4, Soa::Vector3x4>().run(1000);
+#ifdef __AVX2__
+    if (__builtin_cpu_supports("avx2"))
+    {
+        SoaTest<8, Soa::floatx8, Soa::boolx8, Soa::Vector3x8>().run(1000);
+    }
+    else
+    {
+        printf("soa_test: no AVX2 on this cpu, 8-wide types not run\n");
+    }
+#endif
+#ifdef __AVX2__
+    printf("soa_test (%s, avx2): %d checks, %d failures\n", backend, s_checks, s_failures);
+#else
+    printf("soa_test (%s): %d checks, %d failures\n", backend, s_checks, s_failures);
+#endif
+    return s_failures ? 1 : 0;
+}
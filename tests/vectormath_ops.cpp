@@ -0,0 +1,43 @@
+// VectormathOps for the scalar backend, or for SSE with -DRAYT_VECTORMATH_SSE. The backend's
+// namespace is renamed so both can be linked into one program without clashing.
+
+#include "vectormath_ops.h"
+
+#ifdef RAYT_VECTORMATH_SSE
+#define Vectormath VectormathSSE
+#include "../vectormath/SSE/cpp/vectormath_aos.h"
+#else
+#define Vectormath VectormathScalar
+#include "../vectormath/scalar/cpp/vectormath_aos.h"
+#endif
+
+using namespace Vectormath::Aos;
+
+namespace
+{
+    Vector3 in(Vec3f v) { return Vector3(v.x, v.y, v.z); }
+    Vec3f out(const Vector3 &v) { return {float(v.getX()), float(v.getY()), float(v.getZ())}; }
+
+    float opDot(Vec3f a, Vec3f b) { return float(dot(in(a), in(b))); }
+    Vec3f opCross(Vec3f a, Vec3f b) { return out(cross(in(a), in(b))); }
+    float opLength(Vec3f a) { return float(length(in(a))); }
+    Vec3f opNormalize(Vec3f a) { return out(normalize(in(a))); }
+    Vec3f opMulPerElem(Vec3f a, Vec3f b) { return out(mulPerElem(in(a), in(b))); }
+    Vec3f opDivPerElem(Vec3f a, Vec3f b) { return out(divPerElem(in(a), in(b))); }
+    Vec3f opMinPerElem(Vec3f a, Vec3f b) { return out(minPerElem(in(a), in(b))); }
+    Vec3f opMaxPerElem(Vec3f a, Vec3f b) { return out(maxPerElem(in(a), in(b))); }
+    Vec3f opLerp(float t, Vec3f a, Vec3f b) { return out(lerp(t, in(a), in(b))); }
+    Vec3f opAdd(Vec3f a, Vec3f b) { return out(in(a) + in(b)); }
+    Vec3f opSub(Vec3f a, Vec3f b) { return out(in(a) - in(b)); }
+    Vec3f opScale(float s, Vec3f a) { return out(s * in(a)); }
+}
+
+#ifdef RAYT_VECTORMATH_SSE
+extern const VectormathOps sse_ops = {
+    "sse",
+#else
+extern const VectormathOps scalar_ops = {
+    "scalar",
+#endif
+    opDot, opCross, opLength, opNormalize, opMulPerElem, opDivPerElem, opMinPerElem, opMaxPerElem,
+    opLerp, opAdd, opSub, opScale};
@@ -0,0 +1,32 @@
+// The vectormath operations rayt uses, on plain floats, for one backend. vectormath_ops.cpp
+// is compiled once per backend (see `make test`), so backend_test can compare the two.
+
+#ifndef RAYT_TESTS_VECTORMATH_OPS_H
+#define RAYT_TESTS_VECTORMATH_OPS_H
+
+struct Vec3f
+{
+    float x, y, z;
+};
+
+struct VectormathOps
+{
+    const char *name;
+    float (*dot)(Vec3f a, Vec3f b);
+    Vec3f (*cross)(Vec3f a, Vec3f b);
+    float (*length)(Vec3f a);
+    Vec3f (*normalize)(Vec3f a);
+    Vec3f (*mulPerElem)(Vec3f a, Vec3f b);
+    Vec3f (*divPerElem)(Vec3f a, Vec3f b);
+    Vec3f (*minPerElem)(Vec3f a, Vec3f b);
+    Vec3f (*maxPerElem)(Vec3f a, Vec3f b);
+    Vec3f (*lerp)(float t, Vec3f a, Vec3f b);
+    Vec3f (*add)(Vec3f a, Vec3f b);
+    Vec3f (*sub)(Vec3f a, Vec3f b);
+    Vec3f (*scale)(float s, Vec3f a);
+};
+
+extern const VectormathOps scalar_ops;
+extern const VectormathOps sse_ops;
+
+#endif
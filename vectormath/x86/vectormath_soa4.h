@@ -0,0 +1,164 @@
+// Four 3-D vectors in structure-of-arrays format over SSE, for x86 where the
+// ppu/spu Soa headers do not build. Function names follow Vectormath::Soa
+// (dot, cross, length, normalize, mulPerElem, select, ...); lanes are numbered 0-3.
+
+#ifndef _VECTORMATH_SOA4_X86_H
+#define _VECTORMATH_SOA4_X86_H
+
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+namespace Vectormath
+{
+    namespace Soa
+    {
+        // four lane masks, all bits set where true
+        class boolx4
+        {
+        public:
+            boolx4() {}
+            boolx4(__m128 m) : m_v(m) {}
+            boolx4(bool b) : m_v(_mm_castsi128_ps(_mm_set1_epi32(b ? -1 : 0))) {}
+            boolx4(bool b0, bool b1, bool b2, bool b3)
+                : m_v(_mm_castsi128_ps(_mm_setr_epi32(b0 ? -1 : 0, b1 ? -1 : 0, b2 ? -1 : 0, b3 ? -1 : 0))) {}
+
+            __m128 get128() const { return m_v; }
+            // bit k set for a true lane k
+            int bits() const { return _mm_movemask_ps(m_v); }
+            bool get(int lane) const { return (bits() >> lane) & 1; }
+
+            boolx4 operator&(const boolx4 &b) const { return _mm_and_ps(m_v, b.m_v); }
+            boolx4 operator|(const boolx4 &b) const { return _mm_or_ps(m_v, b.m_v); }
+            boolx4 operator!() const { return _mm_xor_ps(m_v, _mm_castsi128_ps(_mm_set1_epi32(-1))); }
+
+        private:
+            __m128 m_v;
+        };
+
+        inline bool any(const boolx4 &b) { return b.bits() != 0; }
+        inline bool all(const boolx4 &b) { return b.bits() == 0xf; }
+
+        class floatx4
+        {
+        public:
+            floatx4() {}
+            floatx4(__m128 v) : m_v(v) {}
+            floatx4(float f) : m_v(_mm_set1_ps(f)) {}
+            floatx4(float f0, float f1, float f2, float f3) : m_v(_mm_setr_ps(f0, f1, f2, f3)) {}
+
+            __m128 get128() const { return m_v; }
+            float get(int lane) const
+            {
+                alignas(16) float f[4];
+                _mm_store_ps(f, m_v);
+                return f[lane];
+            }
+            // four consecutive floats, p need not be aligned
+            static floatx4 load(const float *p) { return _mm_loadu_ps(p); }
+            void store(float *p) const { _mm_storeu_ps(p, m_v); }
+
+            floatx4 operator+(const floatx4 &b) const { return _mm_add_ps(m_v, b.m_v); }
+            floatx4 operator-(const floatx4 &b) const { return _mm_sub_ps(m_v, b.m_v); }
+            floatx4 operator*(const floatx4 &b) const { return _mm_mul_ps(m_v, b.m_v); }
+            floatx4 operator/(const floatx4 &b) const { return _mm_div_ps(m_v, b.m_v); }
+            floatx4 operator-() const { return _mm_xor_ps(m_v, _mm_set1_ps(-0.f)); }
+            floatx4 &operator+=(const floatx4 &b) { return *this = *this + b; }
+            floatx4 &operator-=(const floatx4 &b) { return *this = *this - b; }
+            floatx4 &operator*=(const floatx4 &b) { return *this = *this * b; }
+            floatx4 &operator/=(const floatx4 &b) { return *this = *this / b; }
+
+            boolx4 operator<(const floatx4 &b) const { return _mm_cmplt_ps(m_v, b.m_v); }
+            boolx4 operator<=(const floatx4 &b) const { return _mm_cmple_ps(m_v, b.m_v); }
+            boolx4 operator>(const floatx4 &b) const { return _mm_cmpgt_ps(m_v, b.m_v); }
+            boolx4 operator>=(const floatx4 &b) const { return _mm_cmpge_ps(m_v, b.m_v); }
+
+        private:
+            __m128 m_v;
+        };
+
+        inline floatx4 operator*(float f, const floatx4 &v) { return floatx4(f) * v; }
+        // not sqrtf4 and friends: vectormath/SSE defines those as macros
+        inline floatx4 sqrtx4(const floatx4 &v) { return _mm_sqrt_ps(v.get128()); }
+        inline floatx4 minx4(const floatx4 &a, const floatx4 &b) { return _mm_min_ps(a.get128(), b.get128()); }
+        inline floatx4 maxx4(const floatx4 &a, const floatx4 &b) { return _mm_max_ps(a.get128(), b.get128()); }
+        // select1 ? b : a, per lane
+        inline floatx4 select(const floatx4 &a, const floatx4 &b, const boolx4 &select1)
+        {
+            __m128 m = select1.get128();
+            return _mm_or_ps(_mm_andnot_ps(m, a.get128()), _mm_and_ps(m, b.get128()));
+        }
+
+        class Vector3x4
+        {
+        public:
+            Vector3x4() {}
+            Vector3x4(const floatx4 &x, const floatx4 &y, const floatx4 &z) : m_x(x), m_y(y), m_z(z) {}
+            explicit Vector3x4(const floatx4 &s) : m_x(s), m_y(s), m_z(s) {}
+
+            const floatx4 &getX() const { return m_x; }
+            const floatx4 &getY() const { return m_y; }
+            const floatx4 &getZ() const { return m_z; }
+            Vector3x4 &setX(const floatx4 &x) { m_x = x; return *this; }
+            Vector3x4 &setY(const floatx4 &y) { m_y = y; return *this; }
+            Vector3x4 &setZ(const floatx4 &z) { m_z = z; return *this; }
+            const floatx4 &operator[](int i) const { return i == 0 ? m_x : i == 1 ? m_y : m_z; }
+
+            Vector3x4 operator+(const Vector3x4 &b) const { return Vector3x4(m_x + b.m_x, m_y + b.m_y, m_z + b.m_z); }
+            Vector3x4 operator-(const Vector3x4 &b) const { return Vector3x4(m_x - b.m_x, m_y - b.m_y, m_z - b.m_z); }
+            Vector3x4 operator*(const floatx4 &s) const { return Vector3x4(m_x * s, m_y * s, m_z * s); }
+            Vector3x4 operator/(const floatx4 &s) const { return Vector3x4(m_x / s, m_y / s, m_z / s); }
+            Vector3x4 operator-() const { return Vector3x4(-m_x, -m_y, -m_z); }
+            Vector3x4 &operator+=(const Vector3x4 &b) { return *this = *this + b; }
+            Vector3x4 &operator-=(const Vector3x4 &b) { return *this = *this - b; }
+            Vector3x4 &operator*=(const floatx4 &s) { return *this = *this * s; }
+
+        private:
+            floatx4 m_x;
+            floatx4 m_y;
+            floatx4 m_z;
+        };
+
+        inline Vector3x4 operator*(const floatx4 &s, const Vector3x4 &v) { return v * s; }
+
+        inline floatx4 dot(const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return a.getX() * b.getX() + a.getY() * b.getY() + a.getZ() * b.getZ();
+        }
+
+        inline Vector3x4 cross(const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return Vector3x4(a.getY() * b.getZ() - a.getZ() * b.getY(),
+                             a.getZ() * b.getX() - a.getX() * b.getZ(),
+                             a.getX() * b.getY() - a.getY() * b.getX());
+        }
+
+        inline floatx4 lengthSqr(const Vector3x4 &v) { return dot(v, v); }
+        inline floatx4 length(const Vector3x4 &v) { return sqrtx4(dot(v, v)); }
+        inline Vector3x4 normalize(const Vector3x4 &v) { return v / length(v); }
+
+        inline Vector3x4 mulPerElem(const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return Vector3x4(a.getX() * b.getX(), a.getY() * b.getY(), a.getZ() * b.getZ());
+        }
+        inline Vector3x4 minPerElem(const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return Vector3x4(minx4(a.getX(), b.getX()), minx4(a.getY(), b.getY()), minx4(a.getZ(), b.getZ()));
+        }
+        inline Vector3x4 maxPerElem(const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return Vector3x4(maxx4(a.getX(), b.getX()), maxx4(a.getY(), b.getY()), maxx4(a.getZ(), b.getZ()));
+        }
+        inline Vector3x4 lerp(const floatx4 &t, const Vector3x4 &a, const Vector3x4 &b)
+        {
+            return a + (b - a) * t;
+        }
+        inline Vector3x4 select(const Vector3x4 &a, const Vector3x4 &b, const boolx4 &select1)
+        {
+            return Vector3x4(select(a.getX(), b.getX(), select1),
+                             select(a.getY(), b.getY(), select1),
+                             select(a.getZ(), b.getZ(), select1));
+        }
+    } // namespace Soa
+} // namespace Vectormath
+
+#endif
@@ -0,0 +1,163 @@
+// Eight 3-D vectors in structure-of-arrays format over AVX2, the 8-wide
+// counterpart of vectormath_soa4.h with the same function names; lanes are
+// numbered 0-7. Needs -mavx2 (and optionally -mfma).
+
+#ifndef _VECTORMATH_SOA8_X86_H
+#define _VECTORMATH_SOA8_X86_H
+
+#include <immintrin.h>
+
+namespace Vectormath
+{
+    namespace Soa
+    {
+        // eight lane masks, all bits set where true
+        class boolx8
+        {
+        public:
+            boolx8() {}
+            boolx8(__m256 m) : m_v(m) {}
+            boolx8(bool b) : m_v(_mm256_castsi256_ps(_mm256_set1_epi32(b ? -1 : 0))) {}
+            boolx8(bool b0, bool b1, bool b2, bool b3, bool b4, bool b5, bool b6, bool b7)
+                : m_v(_mm256_castsi256_ps(_mm256_setr_epi32(b0 ? -1 : 0, b1 ? -1 : 0, b2 ? -1 : 0, b3 ? -1 : 0,
+                                                            b4 ? -1 : 0, b5 ? -1 : 0, b6 ? -1 : 0, b7 ? -1 : 0))) {}
+
+            __m256 get256() const { return m_v; }
+            // bit k set for a true lane k
+            int bits() const { return _mm256_movemask_ps(m_v); }
+            bool get(int lane) const { return (bits() >> lane) & 1; }
+
+            boolx8 operator&(const boolx8 &b) const { return _mm256_and_ps(m_v, b.m_v); }
+            boolx8 operator|(const boolx8 &b) const { return _mm256_or_ps(m_v, b.m_v); }
+            boolx8 operator!() const { return _mm256_xor_ps(m_v, _mm256_castsi256_ps(_mm256_set1_epi32(-1))); }
+
+        private:
+            __m256 m_v;
+        };
+
+        inline bool any(const boolx8 &b) { return b.bits() != 0; }
+        inline bool all(const boolx8 &b) { return b.bits() == 0xff; }
+
+        class floatx8
+        {
+        public:
+            floatx8() {}
+            floatx8(__m256 v) : m_v(v) {}
+            floatx8(float f) : m_v(_mm256_set1_ps(f)) {}
+            floatx8(float f0, float f1, float f2, float f3, float f4, float f5, float f6, float f7)
+                : m_v(_mm256_setr_ps(f0, f1, f2, f3, f4, f5, f6, f7)) {}
+
+            __m256 get256() const { return m_v; }
+            float get(int lane) const
+            {
+                alignas(32) float f[8];
+                _mm256_store_ps(f, m_v);
+                return f[lane];
+            }
+            // eight consecutive floats, p need not be aligned
+            static floatx8 load(const float *p) { return _mm256_loadu_ps(p); }
+            void store(float *p) const { _mm256_storeu_ps(p, m_v); }
+
+            floatx8 operator+(const floatx8 &b) const { return _mm256_add_ps(m_v, b.m_v); }
+            floatx8 operator-(const floatx8 &b) const { return _mm256_sub_ps(m_v, b.m_v); }
+            floatx8 operator*(const floatx8 &b) const { return _mm256_mul_ps(m_v, b.m_v); }
+            floatx8 operator/(const floatx8 &b) const { return _mm256_div_ps(m_v, b.m_v); }
+            floatx8 operator-() const { return _mm256_xor_ps(m_v, _mm256_set1_ps(-0.f)); }
+            floatx8 &operator+=(const floatx8 &b) { return *this = *this + b; }
+            floatx8 &operator-=(const floatx8 &b) { return *this = *this - b; }
+            floatx8 &operator*=(const floatx8 &b) { return *this = *this * b; }
+            floatx8 &operator/=(const floatx8 &b) { return *this = *this / b; }
+
+            boolx8 operator<(const floatx8 &b) const { return _mm256_cmp_ps(m_v, b.m_v, _CMP_LT_OQ); }
+            boolx8 operator<=(const floatx8 &b) const { return _mm256_cmp_ps(m_v, b.m_v, _CMP_LE_OQ); }
+            boolx8 operator>(const floatx8 &b) const { return _mm256_cmp_ps(m_v, b.m_v, _CMP_GT_OQ); }
+            boolx8 operator>=(const floatx8 &b) const { return _mm256_cmp_ps(m_v, b.m_v, _CMP_GE_OQ); }
+
+        private:
+            __m256 m_v;
+        };
+
+        inline floatx8 operator*(float f, const floatx8 &v) { return floatx8(f) * v; }
+        inline floatx8 sqrtx8(const floatx8 &v) { return _mm256_sqrt_ps(v.get256()); }
+        inline floatx8 minx8(const floatx8 &a, const floatx8 &b) { return _mm256_min_ps(a.get256(), b.get256()); }
+        inline floatx8 maxx8(const floatx8 &a, const floatx8 &b) { return _mm256_max_ps(a.get256(), b.get256()); }
+        // select1 ? b : a, per lane
+        inline floatx8 select(const floatx8 &a, const floatx8 &b, const boolx8 &select1)
+        {
+            return _mm256_blendv_ps(a.get256(), b.get256(), select1.get256());
+        }
+
+        class Vector3x8
+        {
+        public:
+            Vector3x8() {}
+            Vector3x8(const floatx8 &x, const floatx8 &y, const floatx8 &z) : m_x(x), m_y(y), m_z(z) {}
+            explicit Vector3x8(const floatx8 &s) : m_x(s), m_y(s), m_z(s) {}
+
+            const floatx8 &getX() const { return m_x; }
+            const floatx8 &getY() const { return m_y; }
+            const floatx8 &getZ() const { return m_z; }
+            Vector3x8 &setX(const floatx8 &x) { m_x = x; return *this; }
+            Vector3x8 &setY(const floatx8 &y) { m_y = y; return *this; }
+            Vector3x8 &setZ(const floatx8 &z) { m_z = z; return *this; }
+            const floatx8 &operator[](int i) const { return i == 0 ? m_x : i == 1 ? m_y : m_z; }
+
+            Vector3x8 operator+(const Vector3x8 &b) const { return Vector3x8(m_x + b.m_x, m_y + b.m_y, m_z + b.m_z); }
+            Vector3x8 operator-(const Vector3x8 &b) const { return Vector3x8(m_x - b.m_x, m_y - b.m_y, m_z - b.m_z); }
+            Vector3x8 operator*(const floatx8 &s) const { return Vector3x8(m_x * s, m_y * s, m_z * s); }
+            Vector3x8 operator/(const floatx8 &s) const { return Vector3x8(m_x / s, m_y / s, m_z / s); }
+            Vector3x8 operator-() const { return Vector3x8(-m_x, -m_y, -m_z); }
+            Vector3x8 &operator+=(const Vector3x8 &b) { return *this = *this + b; }
+            Vector3x8 &operator-=(const Vector3x8 &b) { return *this = *this - b; }
+            Vector3x8 &operator*=(const floatx8 &s) { return *this = *this * s; }
+
+        private:
+            floatx8 m_x;
+            floatx8 m_y;
+            floatx8 m_z;
+        };
+
+        inline Vector3x8 operator*(const floatx8 &s, const Vector3x8 &v) { return v * s; }
+
+        inline floatx8 dot(const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return a.getX() * b.getX() + a.getY() * b.getY() + a.getZ() * b.getZ();
+        }
+
+        inline Vector3x8 cross(const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return Vector3x8(a.getY() * b.getZ() - a.getZ() * b.getY(),
+                             a.getZ() * b.getX() - a.getX() * b.getZ(),
+                             a.getX() * b.getY() - a.getY() * b.getX());
+        }
+
+        inline floatx8 lengthSqr(const Vector3x8 &v) { return dot(v, v); }
+        inline floatx8 length(const Vector3x8 &v) { return sqrtx8(dot(v, v)); }
+        inline Vector3x8 normalize(const Vector3x8 &v) { return v / length(v); }
+
+        inline Vector3x8 mulPerElem(const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return Vector3x8(a.getX() * b.getX(), a.getY() * b.getY(), a.getZ() * b.getZ());
+        }
+        inline Vector3x8 minPerElem(const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return Vector3x8(minx8(a.getX(), b.getX()), minx8(a.getY(), b.getY()), minx8(a.getZ(), b.getZ()));
+        }
+        inline Vector3x8 maxPerElem(const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return Vector3x8(maxx8(a.getX(), b.getX()), maxx8(a.getY(), b.getY()), maxx8(a.getZ(), b.getZ()));
+        }
+        inline Vector3x8 lerp(const floatx8 &t, const Vector3x8 &a, const Vector3x8 &b)
+        {
+            return a + (b - a) * t;
+        }
+        inline Vector3x8 select(const Vector3x8 &a, const Vector3x8 &b, const boolx8 &select1)
+        {
+            return Vector3x8(select(a.getX(), b.getX(), select1),
+                             select(a.getY(), b.getY(), select1),
+                             select(a.getZ(), b.getZ(), select1));
+        }
+    } // namespace Soa
+} // namespace Vectormath
+
+#endif